@@ -0,0 +1,86 @@
+/*
+ * arena.cc
+ * Copyright 2026 Zineffable1
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+#include "arena.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+Arena::~Arena ()
+{
+    while (m_blocks)
+    {
+        Block * next = m_blocks->next;
+        free (m_blocks);
+        m_blocks = next;
+    }
+}
+
+void * Arena::alloc (size_t size, size_t align)
+{
+    uintptr_t pos = ((uintptr_t) m_pos + align - 1) & ~(uintptr_t) (align - 1);
+
+    if (! m_pos || pos + size > (uintptr_t) m_end)
+    {
+        /* oversized requests get a block of their own */
+        size_t need = sizeof (Block) + size + align;
+        size_t bytes = (need > block_size) ? need : block_size;
+
+        auto block = (Block *) malloc (bytes);
+        if (! block)
+            throw std::bad_alloc ();
+
+        block->next = m_blocks;
+        m_blocks = block;
+        m_size += bytes;
+
+        m_pos = (char *) (block + 1);
+        m_end = (char *) block + bytes;
+
+        pos = ((uintptr_t) m_pos + align - 1) & ~(uintptr_t) (align - 1);
+    }
+
+    m_pos = (char *) (pos + size);
+    return (void *) pos;
+}
+
+bool StringPool::Key::operator== (const Key & b) const
+{
+    return len == b.len && ! memcmp (str, b.str, len);
+}
+
+const char * StringPool::intern (const char * str, int len)
+{
+    /* FNV-1a */
+    unsigned hash = 2166136261u;
+    for (int i = 0; i < len; i ++)
+        hash = (hash ^ (unsigned char) str[i]) * 16777619u;
+
+    const char * * found = m_strings.lookup ({str, len, hash});
+    if (found)
+        return * found;
+
+    char * copy = m_arena.alloc_array<char> (len + 1);
+    memcpy (copy, str, len);
+    copy[len] = 0;
+
+    m_strings.add ({copy, len, hash}, (const char *) copy);
+    return copy;
+}
@@ -0,0 +1,173 @@
+/*
+ * arena.h
+ * Copyright 2026 Zineffable1
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <new>
+#include <stddef.h>
+#include <type_traits>
+#include <utility>
+
+#include <libaudcore/multihash.h>
+
+// Bump allocator: memory is handed out from large blocks and only released
+// all at once, when the arena is destroyed.  Objects created in an arena
+// are never destructed, so they must be trivially destructible.
+class Arena
+{
+public:
+    Arena () = default;
+    Arena (const Arena &) = delete;
+    Arena & operator= (const Arena &) = delete;
+    ~Arena ();
+
+    void * alloc (size_t size, size_t align);
+
+    template<class T>
+    T * alloc_array (int count)
+    {
+        static_assert (std::is_trivially_destructible<T>::value, "not arena-safe");
+        return (T *) alloc (sizeof (T) * count, alignof (T));
+    }
+
+    template<class T, class ... Args>
+    T * create (Args && ... args)
+    {
+        static_assert (std::is_trivially_destructible<T>::value, "not arena-safe");
+        return new (alloc (sizeof (T), alignof (T))) T (std::forward<Args> (args) ...);
+    }
+
+    // total size of the blocks allocated so far
+    size_t size () const { return m_size; }
+
+private:
+    static constexpr size_t block_size = 1 << 20;
+
+    struct Block {
+        Block * next;
+    };
+
+    Block * m_blocks = nullptr;
+    char * m_pos = nullptr, * m_end = nullptr;
+    size_t m_size = 0;
+};
+
+// Fixed array (or one growing by doubling) living in an Arena.  It mimics
+// the read-only part of Index so that it can be iterated the same way.
+// As many elements as fit in the space of the pointer (two ints, or one
+// pointer) are kept in the array itself; most files have a single entry
+// and most folders few children, so they need no storage of their own.
+// Copies of such a small array are independent of each other, so an array
+// that other code refers to must not be copied and then changed.
+template<class T>
+struct ArenaArray
+{
+    static constexpr int local_size =
+     (sizeof (T) <= sizeof (T *)) ? (int) (sizeof (T *) / sizeof (T)) : 0;
+
+    union {
+        T * heap = nullptr;
+        T local[local_size ? local_size : 1];
+    };
+    int n = 0;
+    int cap = 0;    /* of <heap>, or 0 while the elements are local */
+
+    int len () const { return n; }
+    T & operator[] (int i) const { return begin ()[i]; }
+    T * begin () const { return cap ? heap : const_cast<T *> (local); }
+    T * end () const { return begin () + n; }
+
+    // only within the capacity given to reserve ()
+    void clear () { n = 0; }
+    void append (const T & value) { begin ()[n ++] = value; }
+
+    void insert (int pos, int count)
+    {
+        T * data = begin ();
+        for (int i = n - 1; i >= pos; i --)
+            data[i + count] = data[i];
+        n += count;
+    }
+
+    void remove (int pos, int count)
+    {
+        T * data = begin ();
+        for (int i = pos; i + count < n; i ++)
+            data[i] = data[i + count];
+        n -= count;
+    }
+
+    // replaces the storage; the elements are dropped
+    void reserve (Arena & arena, int capacity)
+    {
+        n = 0;
+        if (capacity <= local_size)
+            cap = 0;
+        else
+        {
+            heap = arena.alloc_array<T> (capacity);
+            cap = capacity;
+        }
+    }
+
+    // grows the array as needed, leaving the old storage behind in the
+    // arena
+    void append (Arena & arena, const T & value)
+    {
+        if (n == (cap ? cap : local_size))
+        {
+            T * old = begin ();
+            int grown_cap = n ? 2 * n : 2;
+            T * grown = arena.alloc_array<T> (grown_cap);
+            for (int i = 0; i < n; i ++)
+                grown[i] = old[i];
+            heap = grown;
+            cap = grown_cap;
+        }
+
+        begin ()[n ++] = value;
+    }
+};
+
+// Stores each distinct string only once, in an Arena.  The pool itself is
+// only needed while adding strings; the strings live as long as the arena.
+class StringPool
+{
+public:
+    explicit StringPool (Arena & arena) : m_arena (arena) {}
+
+    const char * intern (const char * str, int len);
+
+private:
+    struct Key
+    {
+        const char * str;
+        int len;
+        unsigned hash_value;
+
+        bool operator== (const Key & b) const;
+        unsigned hash () const { return hash_value; }
+    };
+
+    Arena & m_arena;
+    SimpleHash<Key, const char *> m_strings;
+};
+
+#endif // ARENA_H
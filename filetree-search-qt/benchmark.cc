@@ -0,0 +1,384 @@
+/*
+ * benchmark.cc
+ * Copyright 2026 Zineffable1
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/* Headless timings of the hot paths of the plugin on synthetic libraries.
+ * Usage: filetree-search-bench [number of paths ...]
+ *
+ * The libraries are generated from a fixed seed, so runs are comparable.
+ * They are laid out like a music collection (genre, artist, album, an
+ * occasional disc folder, tracks), sorted like the Library playlist, with a
+ * sprinkling of non-ASCII names.  Peak memory is that of the whole process
+ * so far, so scales are best run from small to large. */
+
+#include <algorithm>
+#include <chrono>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include <QApplication>
+#include <QImage>
+#include <QPainter>
+#include <QStyleOptionViewItem>
+
+#include <libaudcore/audstrings.h>
+
+#include "html-delegate.h"
+#include "path-set.h"
+#include "search-model.h"
+
+static const char * const genres[] = {
+    "Ambient", "Blues", "Classical", "Electronic", "Folk", "Hip-Hop",
+    "Jazz", "Metal", "Pop", "Reggae", "Rock", "Soundtrack"
+};
+
+static const char * const syllables[] = {
+    "a", "al", "an", "ba", "be", "cor", "da", "del", "dor", "el", "en", "fa",
+    "gi", "ha", "in", "is", "ka", "la", "li", "lo", "ma", "mar", "mi", "mo",
+    "na", "ni", "no", "o", "ra", "re", "ri", "ro", "sa", "se", "so", "sun",
+    "ta", "te", "the", "to", "tri", "u", "va", "ve", "vi", "wo", "xa", "zen"
+};
+
+static const char * const foreign_words[] = {
+    "Björk", "Sigur Rós", "Motörhead", "Café", "Garçon", "Ñandú", "Źródło",
+    "Дом", "Ночь", "東京", "夜明け", "Αθήνα"
+};
+
+static const char * const extensions[] = {".flac", ".mp3", ".ogg", ".opus"};
+
+/* xorshift64*, so that the libraries don't depend on the C library */
+class Random
+{
+public:
+    int range (int n)
+    {
+        m_state ^= m_state >> 12;
+        m_state ^= m_state << 25;
+        m_state ^= m_state >> 27;
+        return (int) ((m_state * 0x2545f4914f6cdd1d) >> 33) % n;
+    }
+
+    template<class T, int N>
+    T pick (T (& array)[N])
+        { return array[range (N)]; }
+
+private:
+    uint64_t m_state = 0x9e3779b97f4a7c15;
+};
+
+static StringBuf make_word (Random & random)
+{
+    StringBuf word (0);
+    int count = 1 + random.range (3);
+    for (int i = 0; i < count; i ++)
+        word.insert (-1, random.pick (syllables));
+
+    word[0] = word[0] - 'a' + 'A';
+    return word;
+}
+
+/* a few words, with names of other scripts mixed in now and then */
+static StringBuf make_name (Random & random, int max_words)
+{
+    StringBuf name (0);
+    int count = 1 + random.range (max_words);
+    for (int i = 0; i < count; i ++)
+    {
+        if (i)
+            name.insert (-1, " ");
+
+        if (random.range (40) == 0)
+            name.insert (-1, random.pick (foreign_words));
+        else
+            name.insert (-1, make_word (random));
+    }
+
+    return name;
+}
+
+/* percent-encodes a path the way filename_to_uri() does */
+static StringBuf path_to_uri (const char * path)
+{
+    StringBuf uri (0);
+    uri.insert (-1, "file://");
+
+    for (const char * c = path; * c; c ++)
+    {
+        unsigned char ch = * c;
+        if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+         (ch >= '0' && ch <= '9') || strchr ("/-_.~", ch))
+        {
+            char buf[2] = {(char) ch, 0};
+            uri.insert (-1, buf);
+        }
+        else
+            uri.insert (-1, str_printf ("%%%02X", ch));
+    }
+
+    return uri;
+}
+
+static const char * const base_path = "/home/user/Music";
+
+static Index<String> generate_library (int count)
+{
+    Random random;
+    Index<String> filenames;
+
+    while (filenames.len () < count)
+    {
+        StringBuf artist = make_name (random, 3);
+        const char * genre = random.pick (genres);
+        int albums = 1 + random.range (8);
+
+        for (int a = 0; a < albums && filenames.len () < count; a ++)
+        {
+            StringBuf album = make_name (random, 4);
+            int year = 1960 + random.range (65);
+            int discs = (random.range (10) == 0) ? 2 + random.range (2) : 1;
+            const char * ext = random.pick (extensions);
+
+            for (int d = 1; d <= discs; d ++)
+            {
+                int tracks = 6 + random.range (14);
+                for (int t = 1; t <= tracks && filenames.len () < count; t ++)
+                {
+                    StringBuf disc = (discs > 1) ? str_printf ("/CD %d", d) : StringBuf (0);
+                    StringBuf title = make_name (random, 5);
+                    StringBuf path = str_printf ("%s/%s/%s/%d - %s%s/%02d - %s%s",
+                     base_path, genre, (const char *) artist, year,
+                     (const char *) album, (const char *) disc, t,
+                     (const char *) title, ext);
+
+                    filenames.append (String (path_to_uri (path)));
+                }
+            }
+        }
+    }
+
+    // the Library playlist is sorted by path
+    std::sort (filenames.begin (), filenames.end (),
+     [] (const String & a, const String & b) { return strcmp (a, b) < 0; });
+
+    return filenames;
+}
+
+class Timer
+{
+public:
+    Timer (const char * what, int scale) :
+        m_what (what), m_scale (scale), m_start (std::chrono::steady_clock::now ()) {}
+
+    ~Timer ()
+    {
+        auto elapsed = std::chrono::steady_clock::now () - m_start;
+        printf ("%8d  %-36s %10.2f ms\n", m_scale, m_what,
+         std::chrono::duration<double, std::milli> (elapsed).count ());
+    }
+
+private:
+    const char * m_what;
+    int m_scale;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+static long peak_memory_kb ()
+{
+    struct rusage usage;
+    getrusage (RUSAGE_SELF, & usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+/* visits every row the way a fully expanded view would, fetching all the
+ * pages; appends up to <limit> indexes in display order to <rows> */
+static int walk_model (SearchModel & model, const QModelIndex & parent,
+ QModelIndexList & rows, int limit)
+{
+    while (model.canFetchMore (parent))
+        model.fetchMore (parent);
+
+    int count = model.rowCount (parent);
+    int total = count;
+
+    for (int r = 0; r < count; r ++)
+    {
+        QModelIndex index = model.index (r, 0, parent);
+        if (model.parent (index) != parent)
+            abort ();
+
+        if (rows.size () < limit)
+            rows.append (index);
+
+        if (model.hasChildren (index))
+            total += walk_model (model, index, rows, limit);
+    }
+
+    return total;
+}
+
+/* exposes the protected painting interface */
+class BenchDelegate : public HtmlDelegate
+{
+public:
+    using HtmlDelegate::paint;
+    using HtmlDelegate::sizeHint;
+};
+
+static void paint_rows (BenchDelegate & delegate, const QModelIndexList & rows)
+{
+    QImage image (400, 40, QImage::Format_ARGB32_Premultiplied);
+    QPainter painter (& image);
+
+    QStyleOptionViewItem option;
+    option.rect = QRect (0, 0, 400, 40);
+    option.font = QApplication::font ();
+    option.palette = QApplication::palette ();
+    option.state = QStyle::State_Enabled | QStyle::State_Active;
+
+    for (auto & index : rows)
+    {
+        delegate.sizeHint (option, index);
+        delegate.paint (& painter, option, index);
+    }
+}
+
+/* the set Library::filter_cb() probes for every file found while adding;
+ * the Library itself needs a running playlist core */
+static void dedupe_filenames (const Index<String> & filenames)
+{
+    PathSet known;
+    known.reset (filenames.len ());
+
+    for (int i = 0; i < filenames.len (); i ++)
+        known.add_entry (filenames[i], i);
+
+    for (auto & filename : filenames)
+    {
+        if (known.check (filename))
+            abort ();
+    }
+
+    if (known.n_found () != filenames.len ())
+        abort ();
+}
+
+static void run_searches (SearchModel & model, int scale, bool match_all)
+{
+    static const char * const queries[] = {
+        // typed one letter at a time, then cleared
+        "s", "su", "sun", "sun l", "sun lo", "",
+        // short words that need a full scan, and longer ones from the index
+        "a", "the", "cd 2", "rock ma", "björk", "東京", ""
+    };
+
+    model.set_match_all (match_all);
+
+    Timer timer (match_all ? "search (all terms, 13 queries)" :
+     "search (any term, 13 queries)", scale);
+
+    for (const char * query : queries)
+        model.do_search (str_list_to_index (str_tolower_utf8 (query), " "));
+}
+
+static void run_scale (int scale)
+{
+    Index<String> filenames = generate_library (scale);
+
+    dedupe_filenames (filenames);
+    {
+        Timer timer ("library dedupe (as filter_cb)", scale);
+        dedupe_filenames (filenames);
+    }
+
+    SmartPtr<Database> database (new Database);
+    {
+        Timer timer ("database build", scale);
+        database->build (filenames, String (path_to_uri (base_path)));
+    }
+
+    size_t arena_size = 0;
+    for (auto & arena : database->arenas)
+        arena_size += arena->size ();
+
+    int items = database->items.len ();
+
+    SearchModel model;
+    model.set_database (Playlist (), std::move (database));
+
+    run_searches (model, scale, false);
+    run_searches (model, scale, true);
+
+    model.set_match_all (false);
+    model.do_search (Index<String> ());
+
+    QModelIndexList rows;
+    int total;
+    {
+        Timer timer ("model walk (all rows)", scale);
+        total = walk_model (model, QModelIndex (), rows, 10000);
+    }
+
+    if (total != items)
+        abort ();
+
+    BenchDelegate delegate;
+    {
+        Timer timer ("delegate, first pass (10k rows)", scale);
+        paint_rows (delegate, rows);
+    }
+    {
+        Timer timer ("delegate, second pass (10k rows)", scale);
+        paint_rows (delegate, rows);
+    }
+
+    printf ("%8d  %d items, %zu kB in arenas, %ld kB peak RSS\n\n", scale,
+     items, arena_size / 1024, peak_memory_kb ());
+}
+
+int main (int argc, char * * argv)
+{
+    if (! qEnvironmentVariableIsSet ("QT_QPA_PLATFORM"))
+        qputenv ("QT_QPA_PLATFORM", "offscreen");
+
+    QApplication app (argc, argv);
+
+    Index<int> scales;
+    for (int i = 1; i < argc; i ++)
+        scales.append (atoi (argv[i]));
+
+    if (! scales.len ())
+    {
+        for (int scale : {10000, 100000, 1000000})
+            scales.append (scale);
+    }
+
+    for (int scale : scales)
+    {
+        if (scale > 0)
+            run_scale (scale);
+    }
+
+    return 0;
+}
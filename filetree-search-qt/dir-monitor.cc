@@ -0,0 +1,649 @@
+/*
+ * dir-monitor.cc
+ * Copyright 2026 Zineffable1
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+#include "dir-monitor.h"
+
+#include <string.h>
+
+#include <atomic>
+#include <thread>
+
+#include <QDirIterator>
+#include <QFileSystemWatcher>
+#include <QSet>
+#include <QStringList>
+
+#include <libaudcore/audstrings.h>
+#include <libaudcore/runtime.h>
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#elif defined(__APPLE__)
+#include <CoreServices/CoreServices.h>
+#include <dispatch/dispatch.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#endif
+
+/* how long a folder has to be left alone before it is reported */
+#define SETTLE_DELAY 500
+
+void DirMonitor::changed (const char * path)
+{
+    auto now = Clock::now ();
+    std::lock_guard<std::mutex> lock (m_mutex);
+
+    bool found = false;
+    for (auto & pending : m_pending)
+    {
+        if (! strcmp (pending.path, path))
+        {
+            pending.last = now;
+            found = true;
+            break;
+        }
+    }
+
+    if (! found)
+        m_pending.append ({String (path), now});
+
+    if (! m_flush_queued)
+    {
+        m_flush.queue (SETTLE_DELAY, [this] () { flush (); });
+        m_flush_queued = true;
+    }
+}
+
+void DirMonitor::flush ()
+{
+    auto now = Clock::now ();
+    auto settle = std::chrono::milliseconds (SETTLE_DELAY);
+    auto wait = settle;
+
+    Index<String> settled;
+
+    {
+        std::lock_guard<std::mutex> lock (m_mutex);
+
+        for (int i = 0; i < m_pending.len ();)
+        {
+            auto idle = now - m_pending[i].last;
+            if (idle >= settle)
+            {
+                settled.append (std::move (m_pending[i].path));
+                m_pending.remove (i, 1);
+            }
+            else
+            {
+                wait = aud::min (wait, std::chrono::duration_cast<std::chrono::milliseconds> (settle - idle));
+                i ++;
+            }
+        }
+
+        // the others are checked again when the first of them settles
+        m_flush_queued = (m_pending.len () > 0);
+        if (m_flush_queued)
+            m_flush.queue (aud::max ((int) wait.count (), 1), [this] () { flush (); });
+    }
+
+    for (auto & path : settled)
+        m_func (path, m_data);
+}
+
+/* Portable fallback: one QFileSystemWatcher watch per folder.  The tree is
+ * walked on a thread, but the watches have to be added on the main thread,
+ * which owns the watcher. */
+class WatcherMonitor : public DirMonitor
+{
+public:
+    WatcherMonitor (const char * path, ChangedFunc func, void * data) :
+        DirMonitor (path, func, data)
+    {
+        QObject::connect (& m_watcher, & QFileSystemWatcher::directoryChanged,
+         [this] (const QString & path) { dir_changed (path); });
+
+        walk (QString ((const char *) m_root));
+    }
+
+    ~WatcherMonitor ()
+    {
+        m_stop = true;
+        if (m_thread.joinable ())
+            m_thread.join ();
+    }
+
+private:
+    void dir_changed (const QString & path)
+    {
+        changed (path.toUtf8 ());
+
+        // watch any folders created inside it
+        if (QDir (path).exists ())
+            walk (path);
+    }
+
+    void walk (const QString & path)
+    {
+        std::lock_guard<std::mutex> lock (m_walk_mutex);
+        if (! m_to_walk.contains (path))
+            m_to_walk.append (path);
+
+        if (m_walking)
+            return;
+
+        if (m_thread.joinable ())
+            m_thread.join ();
+
+        m_walking = true;
+        m_thread = std::thread ([this] () { walk_thread (); });
+    }
+
+    void walk_thread ()
+    {
+        std::unique_lock<std::mutex> lock (m_walk_mutex);
+
+        while (! m_to_walk.isEmpty () && ! m_stop)
+        {
+            QString path = m_to_walk.takeFirst ();
+            lock.unlock ();
+
+            QStringList found (path);
+            QDirIterator it (path, QDir::Dirs | QDir::NoDot | QDir::NoDotDot, QDirIterator::Subdirectories);
+            while (it.hasNext () && ! m_stop)
+                found.append (it.next ());
+
+            lock.lock ();
+            m_found.append (found);
+        }
+
+        m_walking = false;
+        m_walk_done.queue ([this] () { add_found (); });
+    }
+
+    void add_found ()
+    {
+        QStringList found;
+        {
+            std::lock_guard<std::mutex> lock (m_walk_mutex);
+            found = std::move (m_found);
+            m_found.clear ();
+        }
+
+        QSet<QString> watched;
+        for (auto & dir : m_watcher.directories ())
+            watched.insert (dir);
+
+        QStringList paths;
+        for (auto & dir : found)
+        {
+            if (! watched.contains (dir))
+            {
+                watched.insert (dir);
+                paths.append (dir);
+            }
+        }
+
+        if (! paths.isEmpty ())
+            m_watcher.addPaths (paths);
+
+        AUDINFO ("Watching %d folders.\n", (int) watched.size ());
+    }
+
+    QFileSystemWatcher m_watcher;
+
+    std::mutex m_walk_mutex;
+    std::thread m_thread;
+    std::atomic<bool> m_stop {false};
+    bool m_walking = false;
+    QStringList m_to_walk, m_found;
+    QueuedFunc m_walk_done;
+};
+
+#if defined(__linux__)
+
+/* inotify still needs a watch per folder, but only costs one file
+ * descriptor; the thread walks the tree, adds watches for folders as they
+ * are created, and reads the events. */
+class InotifyMonitor : public DirMonitor
+{
+public:
+    InotifyMonitor (const char * path, ChangedFunc func, void * data) :
+        DirMonitor (path, func, data) {}
+
+    ~InotifyMonitor ()
+    {
+        if (m_thread.joinable ())
+        {
+            m_stop = true;
+            if (write (m_wake[1], "", 1) < 0)
+                AUDWARN ("Cannot wake up the monitor: %s\n", strerror (errno));
+
+            m_thread.join ();
+        }
+
+        for (int fd : {m_fd, m_wake[0], m_wake[1]})
+        {
+            if (fd >= 0)
+                close (fd);
+        }
+    }
+
+    bool start ()
+    {
+        m_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+        if (m_fd < 0 || pipe2 (m_wake, O_CLOEXEC) < 0)
+        {
+            AUDWARN ("Cannot set up inotify: %s\n", strerror (errno));
+            return false;
+        }
+
+        m_thread = std::thread ([this] () { run (); });
+        return true;
+    }
+
+private:
+    /* IN_CLOSE_WRITE is only of interest for files still being copied in,
+     * see read_events () */
+    static constexpr uint32_t watch_mask = IN_CREATE | IN_DELETE |
+     IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR | IN_DONT_FOLLOW;
+
+    void run ()
+    {
+        add_tree (std::string ((const char *) m_root));
+        AUDINFO ("Watching %d folders.\n", (int) m_paths.size ());
+
+        pollfd fds[2] = {{m_fd, POLLIN, 0}, {m_wake[0], POLLIN, 0}};
+
+        while (! m_stop)
+        {
+            if (poll (fds, 2, -1) < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+
+                AUDWARN ("Monitoring failed: %s\n", strerror (errno));
+                break;
+            }
+
+            if (fds[0].revents & POLLIN)
+                read_events ();
+        }
+    }
+
+    void add_tree (std::string path)
+    {
+        std::vector<std::string> stack;
+        stack.push_back (std::move (path));
+
+        while (! stack.empty () && ! m_stop)
+        {
+            std::string dir = std::move (stack.back ());
+            stack.pop_back ();
+
+            int wd = inotify_add_watch (m_fd, dir.c_str (), watch_mask);
+            if (wd < 0)
+            {
+                if (errno == ENOSPC && ! m_warned)
+                {
+                    AUDWARN ("Out of inotify watches; raise fs.inotify.max_user_watches "
+                     "to monitor the whole library.\n");
+                    m_warned = true;
+                }
+
+                continue;
+            }
+
+            m_paths[wd] = dir;
+
+            DIR * handle = opendir (dir.c_str ());
+            if (! handle)
+                continue;
+
+            while (struct dirent * entry = readdir (handle))
+            {
+                if (! strcmp (entry->d_name, ".") || ! strcmp (entry->d_name, ".."))
+                    continue;
+
+                std::string child = dir + '/' + entry->d_name;
+                struct stat info;
+
+                if (entry->d_type == DT_DIR || (entry->d_type == DT_UNKNOWN &&
+                 ! lstat (child.c_str (), & info) && S_ISDIR (info.st_mode)))
+                    stack.push_back (std::move (child));
+            }
+
+            closedir (handle);
+        }
+    }
+
+    /* a folder moved away keeps its watches, under the old names */
+    void remove_tree (const std::string & path)
+    {
+        for (auto it = m_paths.begin (); it != m_paths.end ();)
+        {
+            const std::string & dir = it->second;
+            if (! dir.compare (0, path.size (), path) &&
+             (dir.size () == path.size () || dir[path.size ()] == '/'))
+            {
+                inotify_rm_watch (m_fd, it->first);
+                it = m_paths.erase (it);
+            }
+            else
+                it ++;
+        }
+    }
+
+    void read_events ()
+    {
+        alignas (struct inotify_event) char buf[16384];
+        ssize_t len;
+
+        while ((len = read (m_fd, buf, sizeof buf)) > 0)
+        {
+            for (char * ptr = buf; ptr < buf + len;)
+            {
+                auto event = (const struct inotify_event *) ptr;
+                ptr += sizeof (struct inotify_event) + event->len;
+
+                // events were lost; only a full rescan can catch up
+                if (event->mask & IN_Q_OVERFLOW)
+                {
+                    changed (m_root);
+                    continue;
+                }
+
+                auto found = m_paths.find (event->wd);
+                if (found == m_paths.end ())
+                    continue;
+
+                if (event->mask & IN_IGNORED)
+                {
+                    m_paths.erase (found);
+                    continue;
+                }
+
+                std::string dir = found->second;
+
+                if ((event->mask & IN_ISDIR) && event->len)
+                {
+                    std::string child = dir + '/' + event->name;
+                    if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                        add_tree (child);
+                    else if (event->mask & IN_MOVED_FROM)
+                        remove_tree (child);
+                }
+                else if (event->len)
+                {
+                    // A write to a file that was there before (a tag editor,
+                    // say) leaves the tree as it is.  A file created here is
+                    // reported once more when its writer is done, so that
+                    // the folder doesn't settle in the middle of the copy.
+                    std::string child = dir + '/' + event->name;
+                    if (event->mask & IN_CREATE)
+                        m_writing.insert (child);
+                    else if (event->mask & IN_CLOSE_WRITE)
+                    {
+                        if (! m_writing.erase (child))
+                            continue;
+                    }
+                    else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+                        m_writing.erase (child);
+                }
+
+                changed (dir.c_str ());
+            }
+        }
+    }
+
+    int m_fd = -1;
+    int m_wake[2] = {-1, -1};
+    std::thread m_thread;
+    std::atomic<bool> m_stop {false};
+
+    /* only touched by the thread */
+    std::unordered_map<int, std::string> m_paths;
+    std::unordered_set<std::string> m_writing;   // created, not closed yet
+    bool m_warned = false;
+};
+
+#elif defined(__APPLE__)
+
+/* FSEvents watches the whole tree with a single stream.  It reports the
+ * files themselves, so that a file whose contents changed (a tag write,
+ * say) can be told from one that was added, removed or renamed; only the
+ * folders of the latter are passed on. */
+class FSEventsMonitor : public DirMonitor
+{
+public:
+    FSEventsMonitor (const char * path, ChangedFunc func, void * data) :
+        DirMonitor (path, func, data) {}
+
+    ~FSEventsMonitor ()
+    {
+        if (m_stream)
+        {
+            FSEventStreamStop (m_stream);
+            FSEventStreamInvalidate (m_stream);
+            FSEventStreamRelease (m_stream);
+        }
+
+        if (m_queue)
+        {
+            // let a callback that is still running finish
+            dispatch_sync_f (m_queue, nullptr, [] (void *) {});
+            dispatch_release (m_queue);
+        }
+    }
+
+    bool start ()
+    {
+        CFStringRef path = CFStringCreateWithCString (nullptr, m_root, kCFStringEncodingUTF8);
+        CFArrayRef paths = CFArrayCreate (nullptr, (const void * *) & path, 1, & kCFTypeArrayCallBacks);
+        FSEventStreamContext context = {0, this, nullptr, nullptr, nullptr};
+
+        m_stream = FSEventStreamCreate (nullptr, callback, & context, paths,
+         kFSEventStreamEventIdSinceNow, 0.1, kFSEventStreamCreateFlagFileEvents);
+
+        CFRelease (paths);
+        CFRelease (path);
+
+        if (! m_stream)
+            return false;
+
+        m_queue = dispatch_queue_create ("filetree-search.monitor", DISPATCH_QUEUE_SERIAL);
+        FSEventStreamSetDispatchQueue (m_stream, m_queue);
+
+        if (! FSEventStreamStart (m_stream))
+        {
+            AUDWARN ("Cannot start FSEvents stream for %s\n", (const char *) m_root);
+            return false;
+        }
+
+        return true;
+    }
+
+private:
+    static void callback (ConstFSEventStreamRef, void * me, size_t n_events,
+     void * event_paths, const FSEventStreamEventFlags flags[], const FSEventStreamEventId[])
+    {
+        auto monitor = (FSEventsMonitor *) me;
+        auto paths = (char * *) event_paths;
+
+        for (size_t i = 0; i < n_events; i ++)
+        {
+            // events were lost; only a full rescan can catch up
+            if (flags[i] & (kFSEventStreamEventFlagUserDropped | kFSEventStreamEventFlagKernelDropped))
+            {
+                monitor->changed (monitor->m_root);
+                continue;
+            }
+
+            if (! (flags[i] & (kFSEventStreamEventFlagItemCreated |
+             kFSEventStreamEventFlagItemRemoved | kFSEventStreamEventFlagItemRenamed)))
+                continue;
+
+            // the folder holding the item
+            const char * slash = strrchr (paths[i], '/');
+            if (! slash)
+                continue;
+
+            StringBuf path = str_copy (paths[i], aud::max ((int) (slash - paths[i]), 1));
+            monitor->changed (path);
+        }
+    }
+
+    FSEventStreamRef m_stream = nullptr;
+    dispatch_queue_t m_queue = nullptr;
+};
+
+#elif defined(_WIN32)
+
+/* ReadDirectoryChangesW watches the whole tree with a single handle; the
+ * folders are those of the names it reports.  Only names are watched, not
+ * writes, so that a tag write doesn't rescan the folder. */
+class WinMonitor : public DirMonitor
+{
+public:
+    WinMonitor (const char * path, ChangedFunc func, void * data) :
+        DirMonitor (path, func, data) {}
+
+    ~WinMonitor ()
+    {
+        if (m_thread.joinable ())
+        {
+            SetEvent (m_stop);
+            m_thread.join ();
+        }
+
+        if (m_stop)
+            CloseHandle (m_stop);
+        if (m_dir != INVALID_HANDLE_VALUE)
+            CloseHandle (m_dir);
+    }
+
+    bool start ()
+    {
+        m_dir = CreateFileW ((LPCWSTR) QString ((const char *) m_root).utf16 (), FILE_LIST_DIRECTORY,
+         FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+         OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, nullptr);
+
+        if (m_dir == INVALID_HANDLE_VALUE)
+        {
+            AUDWARN ("Cannot open %s for monitoring\n", (const char *) m_root);
+            return false;
+        }
+
+        m_stop = CreateEventW (nullptr, true, false, nullptr);
+        if (! m_stop)
+            return false;
+
+        m_thread = std::thread ([this] () { run (); });
+        return true;
+    }
+
+private:
+    void run ()
+    {
+        OVERLAPPED overlapped = OVERLAPPED ();
+        overlapped.hEvent = CreateEventW (nullptr, false, false, nullptr);
+
+        alignas (DWORD) char buf[65536];
+        QString root ((const char *) m_root);
+
+        while (ReadDirectoryChangesW (m_dir, buf, sizeof buf, true,
+         FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME,
+         nullptr, & overlapped, nullptr))
+        {
+            HANDLE handles[2] = {overlapped.hEvent, m_stop};
+            DWORD bytes = 0;
+
+            if (WaitForMultipleObjects (2, handles, false, INFINITE) != WAIT_OBJECT_0)
+            {
+                CancelIo (m_dir);
+                GetOverlappedResult (m_dir, & overlapped, & bytes, true);
+                break;
+            }
+
+            if (! GetOverlappedResult (m_dir, & overlapped, & bytes, false))
+                break;
+
+            // the buffer overflowed; only a full rescan can catch up
+            if (! bytes)
+            {
+                changed (m_root);
+                continue;
+            }
+
+            for (auto info = (const FILE_NOTIFY_INFORMATION *) buf;;)
+            {
+                QString name = QString::fromWCharArray (info->FileName,
+                 info->FileNameLength / sizeof (WCHAR));
+
+                int slash = name.lastIndexOf ('\\');
+                QString dir = (slash < 0) ? root : root + '\\' + name.left (slash);
+                changed (dir.toUtf8 ());
+
+                if (! info->NextEntryOffset)
+                    break;
+
+                info = (const FILE_NOTIFY_INFORMATION *) ((const char *) info + info->NextEntryOffset);
+            }
+        }
+
+        CloseHandle (overlapped.hEvent);
+    }
+
+    HANDLE m_dir = INVALID_HANDLE_VALUE;
+    HANDLE m_stop = nullptr;
+    std::thread m_thread;
+};
+
+#endif
+
+DirMonitor * DirMonitor::create (const char * path, ChangedFunc func, void * data)
+{
+#if defined(__linux__)
+    auto native = new InotifyMonitor (path, func, data);
+#elif defined(__APPLE__)
+    auto native = new FSEventsMonitor (path, func, data);
+#elif defined(_WIN32)
+    auto native = new WinMonitor (path, func, data);
+#endif
+
+#if defined(__linux__) || defined(__APPLE__) || defined(_WIN32)
+    if (native->start ())
+        return native;
+
+    delete native;
+    AUDWARN ("Falling back to QFileSystemWatcher.\n");
+#endif
+
+    return new WatcherMonitor (path, func, data);
+}
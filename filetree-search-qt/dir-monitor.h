@@ -0,0 +1,78 @@
+/*
+ * dir-monitor.h
+ * Copyright 2026 Zineffable1
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+#ifndef DIR_MONITOR_H
+#define DIR_MONITOR_H
+
+#include <chrono>
+#include <mutex>
+
+#include <libaudcore/index.h>
+#include <libaudcore/mainloop.h>
+#include <libaudcore/objects.h>
+
+/* Watches a folder and everything below it for files and folders being
+ * added, removed, renamed or rewritten.  The folders whose contents changed
+ * are reported on the main thread, each one once changes to it have settled
+ * for a while, so that copying an album in makes for a single report.
+ *
+ * The work is left to the platform where it can watch a whole tree at once
+ * (FSEvents, ReadDirectoryChangesW); inotify and QFileSystemWatcher need a
+ * watch per folder, which are set up by walking the tree off the main
+ * thread. */
+class DirMonitor
+{
+public:
+    typedef void (* ChangedFunc) (const char * path, void * data);
+
+    /* <path> is a local folder name without a trailing slash; <func> is
+     * passed the folders below it that changed, in the same form */
+    static DirMonitor * create (const char * path, ChangedFunc func, void * data);
+
+    virtual ~DirMonitor () {}
+
+protected:
+    DirMonitor (const char * path, ChangedFunc func, void * data) :
+        m_root (path), m_func (func), m_data (data) {}
+
+    /* called by the backends, from any thread */
+    void changed (const char * path);
+
+    const String m_root;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Pending {
+        String path;
+        Clock::time_point last;
+    };
+
+    void flush ();
+
+    ChangedFunc m_func;
+    void * m_data;
+
+    std::mutex m_mutex;
+    Index<Pending> m_pending;
+    bool m_flush_queued = false;
+    QueuedFunc m_flush;
+};
+
+#endif // DIR_MONITOR_H
@@ -32,14 +32,40 @@ static void init_text_document (QTextDocument & doc, const QStyleOptionViewItem
     doc.setDefaultFont (option.font);
 }
 
+// Parsing and laying out the HTML is by far the slowest part of painting,
+// so the documents of recently shown rows are kept around.  The text and
+// font are checked on each hit; colors come from the paint context, so the
+// palette doesn't matter, and labels aren't wrapped, so the width doesn't.
+const QTextDocument & HtmlDelegate::get_label (const QStyleOptionViewItem & option,
+                                               const QModelIndex & index) const
+{
+    const void * key = index.internalPointer ();
+    Label * label = m_cache.object (key);
+
+    if (label && label->html == option.text && label->font == option.font)
+        m_stats.hits ++;
+    else
+    {
+        m_stats.misses ++;
+        label = new Label;
+        label->html = option.text;
+        label->font = option.font;
+        init_text_document (label->doc, option);
+        label->doc.size (); // lay it out now
+        m_cache.insert (key, label);
+    }
+
+    return label->doc;
+}
+
 void HtmlDelegate::paint (QPainter * painter, const QStyleOptionViewItem & option_,
                           const QModelIndex & index) const
 {
     QStyleOptionViewItem option = option_;
     initStyleOption (& option, index);
 
-    QTextDocument doc;
-    init_text_document (doc, option);
+    const QTextDocument & doc = get_label (option, index);
+    m_stats.painted ++;
 
     QStyle * style = option.widget ? option.widget->style () : qApp->style ();
     QAbstractTextDocumentLayout::PaintContext ctx;
@@ -75,8 +101,7 @@ QSize HtmlDelegate::sizeHint (const QStyleOptionViewItem & option_,
     QStyleOptionViewItem option = option_;
     initStyleOption (& option, index);
 
-    QTextDocument doc;
-    init_text_document (doc, option);
+    const QTextDocument & doc = get_label (option, index);
 
     return QSize (audqt::sizes.OneInch, doc.size ().height ());
 }
\ No newline at end of file
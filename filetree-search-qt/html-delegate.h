@@ -20,16 +20,49 @@
 #ifndef HTMLDELEGATE_H
 #define HTMLDELEGATE_H
 
+#include <QCache>
+#include <QFont>
 #include <QStyledItemDelegate>
+#include <QTextDocument>
 
 // Allow rich text in QTreeView entries
 class HtmlDelegate : public QStyledItemDelegate
 {
+public:
+    // Rows painted, and how the label cache did, since the last call
+    struct Stats {
+        int painted, hits, misses;
+    };
+
+    Stats take_stats ()
+    {
+        Stats stats = m_stats;
+        m_stats = Stats ();
+        return stats;
+    }
+
+    // Drops the laid-out labels; needed when the model's items (which are
+    // told apart by their internal pointers) are replaced
+    void clear_cache () { m_cache.clear (); }
+
 protected:
     void paint (QPainter * painter, const QStyleOptionViewItem & option,
                 const QModelIndex & index) const override;
     QSize sizeHint (const QStyleOptionViewItem & option,
                     const QModelIndex & index) const override;
+
+private:
+    struct Label {
+        QString html;
+        QFont font;
+        QTextDocument doc;
+    };
+
+    const QTextDocument & get_label (const QStyleOptionViewItem & option,
+                                     const QModelIndex & index) const;
+
+    mutable QCache<const void *, Label> m_cache {4096};
+    mutable Stats m_stats = Stats ();
 };
 
 #endif // HTMLDELEGATE_H
@@ -19,11 +19,18 @@
 
 #include "library.h"
 
+#include <algorithm>
 #include <string.h>
+#include <thread>
+#include <libaudcore/audstrings.h>
 #include <libaudcore/i18n.h>
 
-aud::spinlock Library::s_adding_lock;
-Library * Library::s_adding_library = nullptr;
+/* beyond this many runs of new entries, sorting the playlist is quicker
+ * than moving each run into place */
+#define MAX_MOVES 256
+
+std::atomic<Library *> Library::s_adding_library {nullptr};
+std::atomic<int> Library::s_filtering {0};
 
 void Library::find_playlist ()
 {
@@ -65,28 +72,75 @@ bool Library::check_playlist (bool require_added, bool require_scanned)
 
 void Library::set_adding (bool adding)
 {
-    auto lh = s_adding_lock.take ();
     s_adding_library = adding ? this : nullptr;
+
+    /* a filter_cb () that got hold of us before may still be running */
+    if (! adding)
+    {
+        while (s_filtering)
+            std::this_thread::yield ();
+    }
 }
 
 bool Library::filter_cb (const char * filename, void *)
 {
     bool add = false;
-    auto lh = s_adding_lock.take ();
+    s_filtering ++;
 
-    if (s_adding_library)
+    /* The adder asks about the folders as well, before it lists them, and
+     * about files it can't play.  Neither ever becomes an entry, so which
+     * of the new names were files is only told by what the adder added. */
+    if (Library * library = s_adding_library)
     {
-        bool * added = s_adding_library->m_added_table.lookup (String (filename));
-
-        if ((add = ! added))
-            s_adding_library->m_added_table.add (String (filename), true);
-        else
-            (* added) = true;
+        add = library->m_known.check (filename);
+        library->m_files_found.fetch_add (1, std::memory_order_relaxed);
     }
 
+    s_filtering --;
     return add;
 }
 
+/* Fills m_known with the entries whose names start with <prefix> (all of
+ * them if null).  Duplicate entries are removed from the playlist. */
+void Library::fill_known (const char * prefix)
+{
+    int prefix_len = prefix ? strlen (prefix) : 0;
+    int entries = m_playlist.n_entries ();
+
+    Index<String> filenames;
+    Index<int> numbers;
+
+    for (int entry = 0; entry < entries; entry ++)
+    {
+        String filename = m_playlist.entry_filename (entry);
+        if (! prefix || ! strncmp (filename, prefix, prefix_len))
+        {
+            filenames.append (std::move (filename));
+            numbers.append (entry);
+        }
+    }
+
+    m_known.reset (filenames.len ());
+
+    Index<int> duplicates;
+    for (int i = 0; i < filenames.len (); i ++)
+    {
+        if (! m_known.add_entry (filenames[i], numbers[i]))
+            duplicates.append (numbers[i]);
+    }
+
+    if (! duplicates.len ())
+        return;
+
+    /* the entries after them move up, so start over; this is rare */
+    m_playlist.select_all (false);
+    for (int entry : duplicates)
+        m_playlist.select_entry (entry, true);
+
+    m_playlist.remove_selected ();
+    fill_known (prefix);
+}
+
 void Library::begin_add (const char * uri)
 {
     if (s_adding_library)
@@ -95,35 +149,68 @@ void Library::begin_add (const char * uri)
     if (! check_playlist (false, false))
         create_playlist ();
 
-    m_added_table.clear ();
+    fill_known (nullptr);
+    m_merge = (m_known.n_entries () > 0);
 
-    int entries = m_playlist.n_entries ();
+    /* a folder rescan whose new entries are still being scanned is
+     * overtaken; its changes would not cover this add */
+    m_rescan_active = m_changes_ready = false;
+    m_rescanning = String ();
+    m_changed.clear ();
 
-    for (int entry = 0; entry < entries; entry ++)
-    {
-        String filename = m_playlist.entry_filename (entry);
+    m_add_timer.restart ();
+    m_files_found = 0;
+    m_entries_before = m_playlist.n_entries ();
 
-        if (! m_added_table.lookup (filename))
-        {
-            m_playlist.select_entry (entry, false);
-            m_added_table.add (filename, false);
-        }
-        else
-            m_playlist.select_entry (entry, true);
-    }
+    set_adding (true);
 
-    m_playlist.remove_selected ();
+    Index<PlaylistAddItem> add;
+    add.append (String (uri));
+    m_playlist.insert_filtered (-1, std::move (add), filter_cb, nullptr, false);
+}
+
+bool Library::begin_rescan (const char * uri)
+{
+    if (s_adding_library || m_rescan_active || ! m_is_ready || ! check_playlist (true, false))
+        return false;
+
+    /* only the entries inside the folder have to be found again */
+    fill_known (str_concat ({uri, "/"}));
+    m_merge = true;
+
+    m_add_timer.restart ();
+    m_files_found = 0;
+    m_entries_before = m_playlist.n_entries ();
+    m_rescanning = String (uri);
+    m_rescan_active = true;
 
     set_adding (true);
 
     Index<PlaylistAddItem> add;
     add.append (String (uri));
     m_playlist.insert_filtered (-1, std::move (add), filter_cb, nullptr, false);
+
+    return true;
 }
 
 void Library::check_ready_and_update (bool force)
 {
     bool now_ready = check_playlist (true, true);
+
+    /* A folder rescan leaves the rest of the library usable, so it doesn't
+     * make it unready.  The tree can be patched as soon as the new entries
+     * are sorted in, without waiting for their metadata. */
+    if (m_rescan_active)
+    {
+        if (m_changes_ready && check_playlist (true, false) && update_func)
+            update_func (update_data);
+
+        if (now_ready && ! m_rescanning)
+            m_rescan_active = false;
+
+        return;
+    }
+
     if (now_ready != m_is_ready || force)
     {
         m_is_ready = now_ready;
@@ -132,6 +219,196 @@ void Library::check_ready_and_update (bool force)
     }
 }
 
+bool Library::take_changes (Index<String> & folders)
+{
+    if (! m_changes_ready)
+        return false;
+
+    folders = std::move (m_changed);
+    m_changed.clear ();
+    m_changes_ready = false;
+    return true;
+}
+
+/* the length of the longest folder (with the slash) holding both <a> and <b> */
+static int common_folder (const char * a, const char * b)
+{
+    int len = 0;
+    for (int i = 0; a[i] && a[i] == b[i]; i ++)
+    {
+        if (a[i] == '/')
+            len = i + 1;
+    }
+
+    return len;
+}
+
+/* Drops the entries the scan didn't find, in one go. */
+void Library::remove_missing (Index<String> & changed)
+{
+    int entries = m_playlist.n_entries ();
+
+    m_playlist.select_all (false);
+    m_known.for_each_missing ([&] (int entry, const char * name) {
+        /* unless the playlist was changed during the scan */
+        if (entry >= entries || strcmp (m_playlist.entry_filename (entry), name))
+            return;
+
+        m_playlist.select_entry (entry, true);
+        changed.append (String (str_copy (name, strrchr (name, '/') + 1 - name)));
+    });
+
+    m_playlist.remove_selected ();
+}
+
+/* Moves the <count> entries at the end of the playlist, which the scan has
+ * just added, to where they belong in the Path order the others are in.
+ * New entries that go next to each other are moved as a run, so that a few
+ * new files cost a few moves.  Returns false if there are too many runs,
+ * since sorting is quicker then. */
+bool Library::place_new_entries (int count, Index<String> & changed)
+{
+    int old = m_playlist.n_entries () - count;
+
+    /* the new entries in Path order, by their place at the end */
+    Index<String> names;
+    Index<int> order;
+    for (int i = 0; i < count; i ++)
+    {
+        names.append (m_playlist.entry_filename (old + i));
+        order.append (i);
+    }
+
+    std::sort (order.begin (), order.end (), [& names] (int a, int b)
+        { return str_compare_encoded (names[a], names[b]) < 0; });
+
+    /* where each one goes among the others, and the runs: neighbours that
+     * go to the same place and were added in that order */
+    Index<int> positions, run_starts;
+    for (int k = 0; k < count; k ++)
+    {
+        const char * filename = names[order[k]];
+        int low = k ? positions[k - 1] : 0;
+        int high = old;
+
+        while (low < high)
+        {
+            int mid = low + (high - low) / 2;
+            if (str_compare_encoded (m_playlist.entry_filename (mid), filename) < 0)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+
+        if (! k || low != positions[k - 1] || order[k] < order[k - 1])
+        {
+            if (run_starts.len () == MAX_MOVES)
+                return false;
+
+            run_starts.append (k);
+        }
+
+        positions.append (low);
+
+        /* the deepest folder already there that holds the file */
+        int len = 0;
+        if (low > 0)
+            len = common_folder (filename, m_playlist.entry_filename (low - 1));
+        if (low < old)
+            len = aud::max (len, common_folder (filename, m_playlist.entry_filename (low)));
+
+        changed.append (String (str_copy (filename, len)));
+    }
+
+    Index<int> run_of;
+    run_of.insert (0, count);
+    for (int r = 0; r < run_starts.len (); r ++)
+    {
+        int end = (r + 1 < run_starts.len ()) ? run_starts[r + 1] : count;
+        for (int k = run_starts[r]; k < end; k ++)
+            run_of[order[k]] = r;
+    }
+
+    /* The runs go in from the top, each one gathered by shift_entries ()
+     * in front of the entry it goes before.  The entries still at the end
+     * keep their order, after the <placed> ones moved up so far. */
+    int placed = 0;
+
+    for (int r = 0; r < run_starts.len (); r ++)
+    {
+        m_playlist.select_all (false);
+
+        int first = -1, len = 0;
+        for (int i = 0, row = old + placed; i < count; i ++)
+        {
+            if (run_of[i] < r)
+                continue;
+
+            if (run_of[i] == r)
+            {
+                m_playlist.select_entry (row, true);
+                if (first < 0)
+                    first = row;
+                len ++;
+            }
+
+            row ++;
+        }
+
+        int distance = positions[run_starts[r]] + placed - first;
+        if (m_playlist.shift_entries (first, distance) != distance)
+        {
+            m_playlist.select_all (false);
+            return false;
+        }
+
+        placed += len;
+    }
+
+    m_playlist.select_all (false);
+    return true;
+}
+
+/* Keeps the outermost of the changed folders (given with a slash at the
+ * end), in playlist order, without the slashes. */
+void Library::set_changes (Index<String> && changed)
+{
+    int scope = m_rescanning ? strlen (m_rescanning) + 1 : 0;
+
+    /* a file right inside the rescanned folder, or one that was sorted
+     * in somewhere outside it, changes the whole folder */
+    for (auto & folder : changed)
+    {
+        if ((int) strlen (folder) < scope)
+            folder = String (str_concat ({m_rescanning, "/"}));
+    }
+
+    changed.sort ([] (const String & a, const String & b)
+        { return str_compare_encoded (a, b); });
+
+    m_changed.clear ();
+    for (auto & folder : changed)
+    {
+        bool inside = false;
+        for (auto & outer : m_changed)
+        {
+            if (! strncmp (folder, outer, strlen (outer)))
+            {
+                inside = true;
+                break;
+            }
+        }
+
+        if (! inside)
+            m_changed.append (folder);
+    }
+
+    for (auto & folder : m_changed)
+        folder = String (str_copy (folder, strlen (folder) - 1));
+
+    m_changes_ready = true;
+}
+
 void Library::add_complete ()
 {
     if (! check_playlist (true, false))
@@ -141,24 +418,48 @@ void Library::add_complete ()
     {
         set_adding (false);
 
-        int entries = m_playlist.n_entries ();
+        /* what the adder added is what was new */
+        int found = m_files_found;
+        int added = aud::max (m_playlist.n_entries () - m_entries_before, 0);
+        int missing = m_known.n_entries () - m_known.n_found ();
 
-        for (int entry = 0; entry < entries; entry ++)
-        {
-            String filename = m_playlist.entry_filename (entry);
-            bool * added = m_added_table.lookup (filename);
+        AUDINFO ("Library scan found %d files (%d new, %d gone) in %.0f ms\n",
+         found, added, missing, m_add_timer.elapsed_ms ());
 
-            m_playlist.select_entry (entry, ! added || ! (* added));
-        }
+        /* The new files were added at the end, so the entries known before
+         * still have their numbers.  Don't clear the playlist if nothing
+         * was found at all, unless it was a folder that went away. */
+        bool rescan = (bool) m_rescanning;
+        Index<String> changed;
 
-        m_added_table.clear ();
+        if (missing && (found || (rescan && missing < m_entries_before)))
+            remove_missing (changed);
 
-        /* don't clear the playlist if nothing was added */
-        if (m_playlist.n_selected () < entries)
-            m_playlist.remove_selected ();
-        else
-            m_playlist.select_all (false);
+        m_known.clear ();
+
+        bool placed = (m_merge && (! added || place_new_entries (added, changed)));
+        if (added && ! placed)
+            m_sort_pending = true;
+
+        /* The changes are patched into the tree, after a full add as well
+         * as after a rescan.  A rescan whose new entries are sorted in has
+         * the whole folder patched; a first or a sorted full add has the
+         * tree built anew. */
+        if (rescan && ! placed)
+            changed.append (String (str_concat ({m_rescanning, "/"})));
+
+        if (rescan || placed)
+            set_changes (std::move (changed));
+
+        m_rescanning = String ();
+    }
+
+    /* once the files added at the end are all there */
+    if (m_sort_pending && ! m_playlist.add_in_progress ())
+    {
+        m_sort_pending = false;
 
+        StopWatch timer ("Sorting the library");
         m_playlist.sort_entries (Playlist::Path);
     }
 
@@ -172,7 +473,10 @@ void Library::scan_complete ()
         check_ready_and_update (false);
 }
 
+/* The tree is made of the filenames alone, so a Metadata update (one
+ * comes with each entry the Browser scan waits for) doesn't call for an
+ * update of its own. */
 void Library::playlist_update ()
 {
-    check_ready_and_update (m_playlist.update_detail ().level >= Playlist::Metadata);
+    check_ready_and_update (m_playlist.update_detail ().level >= Playlist::Structure);
 }
@@ -20,10 +20,14 @@
 #ifndef LIBRARY_H
 #define LIBRARY_H
 
+#include <atomic>
+
 #include <libaudcore/hook.h>
-#include <libaudcore/multihash.h>
 #include <libaudcore/playlist.h>
 
+#include "path-set.h"
+#include "timing.h"
+
 class Library
 {
 public:
@@ -34,8 +38,17 @@ public:
     bool is_ready () const { return m_is_ready; }
 
     void begin_add (const char * uri);
+    /* rescans just the folder <uri> inside the library, which stays ready
+     * meanwhile; returns false if another scan is still running */
+    bool begin_rescan (const char * uri);
     void check_ready_and_update (bool force);
 
+    /* After a scan that merged its files into the playlist (a rescan, or
+     * an add over the entries there were), the folders whose entries
+     * changed, in playlist order and none inside another; returns false if
+     * there was no such scan since the last call. */
+    bool take_changes (Index<String> & folders);
+
     void connect_update (void (* func) (void *), void * data) {
         update_func = func;
         update_data = data;
@@ -48,6 +61,10 @@ private:
     void set_adding (bool adding);
 
     static bool filter_cb (const char * filename, void *);
+    void fill_known (const char * prefix);
+    void remove_missing (Index<String> & changed);
+    bool place_new_entries (int count, Index<String> & changed);
+    void set_changes (Index<String> && changed);
 
     void add_complete (void);
     void scan_complete (void);
@@ -55,11 +72,27 @@ private:
 
     Playlist m_playlist;
     bool m_is_ready = false;
-    SimpleHash<String, bool> m_added_table;
+    PathSet m_known;   // the entries a scan may find again
+
+    /* how the last scan went, for the log */
+    StopWatch m_add_timer;
+    std::atomic<int> m_files_found {0};
+
+    /* The files that are not in the playlist yet are added at the end and
+     * then moved into place, so that the playlist needn't be sorted again.
+     * Only the first scan just adds them and sorts. */
+    int m_entries_before = 0;
+    bool m_merge = false, m_sort_pending = false;
+
+    /* folder rescan: running until the new entries are scanned, too */
+    bool m_rescan_active = false, m_changes_ready = false;
+    String m_rescanning;
+    Index<String> m_changed;
 
-    /* to allow safe callback access from playlist add thread */
-    static aud::spinlock s_adding_lock;
-    static Library * s_adding_library;
+    /* to allow safe callback access from playlist add thread: set_adding ()
+     * waits for the callbacks that may still see the old value */
+    static std::atomic<Library *> s_adding_library;
+    static std::atomic<int> s_filtering;
 
     void (* update_func) (void *) = nullptr;
     void * update_data = nullptr;
@@ -0,0 +1,327 @@
+/*
+ * name-match.cc
+ * Copyright 2026 Zineffable1
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+#include "name-match.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define USE_X86
+#include <immintrin.h>
+#elif defined(__GNUC__) && (defined(__aarch64__) || defined(__ARM_NEON))
+#define USE_NEON
+#include <arm_neon.h>
+#endif
+
+/* longer names take the scalar path */
+static constexpr int max_name = 1024;
+
+/* the kernels may read this far past the end of the copied name */
+static constexpr int padding = 64;
+
+typedef TermMatcher::Term Term;
+typedef unsigned (* MatchFunc) (char * buf, int len, const Term * terms, unsigned mask);
+
+bool is_ascii (const char * str)
+{
+    for (; * str; str ++)
+    {
+        if ((unsigned char) * str >= 0x80)
+            return false;
+    }
+
+    return true;
+}
+
+bool contains_folded (const char * name, const char * term)
+{
+    unsigned char first = term[0];
+    if (! first)
+        return true;
+
+    /* let the C library find the candidate positions */
+    char accept[3] = {(char) first, 0, 0};
+    if (first >= 'a' && first <= 'z')
+        accept[1] = first - ('a' - 'A');
+
+    for (name = strpbrk (name, accept); name; name = strpbrk (name + 1, accept))
+    {
+        int i = 1;
+        while (term[i] && fold_ascii (name[i]) == (unsigned char) term[i])
+            i ++;
+
+        if (! term[i])
+            return true;
+    }
+
+    return false;
+}
+
+int start_folded (const char * name, const char * term)
+{
+    int i = 0;
+    while (term[i] && fold_ascii (name[i]) == (unsigned char) term[i])
+        i ++;
+
+    if (term[i])
+        return 0;
+
+    return name[i] ? 1 : 2;
+}
+
+/* Checks a candidate position whose first and last bytes already match. */
+static inline bool check_middle (const char * buf, const Term & term)
+{
+    return term.len <= 2 || ! memcmp (buf + 1, term.str + 1, term.len - 2);
+}
+
+/* Fallback for platforms without a vector kernel.  <buf> is unused. */
+static unsigned match_scalar (char * buf, int, const Term * terms, unsigned mask)
+{
+    unsigned found = 0;
+
+    for (unsigned m = mask; m; m &= m - 1)
+    {
+        int t = __builtin_ctz (m);
+        if (contains_folded (buf, terms[t].str))
+            found |= 1u << t;
+    }
+
+    return found;
+}
+
+/*
+ * The vector kernels all work the same way: the (copied and zero-padded)
+ * name is folded in place, then each block of the name is compared with the
+ * first and last bytes of every term that has not been found yet.  Only the
+ * positions where both match are compared in full.  Since terms contain no
+ * zero bytes, candidates running into the padding never match.
+ */
+
+#ifdef USE_X86
+
+static unsigned match_sse2 (char * buf, int len, const Term * terms, unsigned mask)
+{
+    const __m128i bias = _mm_set1_epi8 ((char) (0x80 - 'A'));
+    const __m128i limit = _mm_set1_epi8 ((char) (-0x80 + 26));
+    const __m128i lower = _mm_set1_epi8 (0x20);
+
+    for (int i = 0; i < len; i += 16)
+    {
+        __m128i c = _mm_load_si128 ((const __m128i *) (buf + i));
+        __m128i upper = _mm_cmplt_epi8 (_mm_add_epi8 (c, bias), limit);
+        _mm_store_si128 ((__m128i *) (buf + i), _mm_or_si128 (c, _mm_and_si128 (upper, lower)));
+    }
+
+    __m128i first[TermMatcher::max_terms], last[TermMatcher::max_terms];
+    for (unsigned m = mask; m; m &= m - 1)
+    {
+        int t = __builtin_ctz (m);
+        first[t] = _mm_set1_epi8 (terms[t].str[0]);
+        last[t] = _mm_set1_epi8 (terms[t].str[terms[t].len - 1]);
+    }
+
+    unsigned found = 0;
+
+    for (int i = 0; i < len && mask; i += 16)
+    {
+        __m128i block = _mm_load_si128 ((const __m128i *) (buf + i));
+
+        for (unsigned m = mask; m; m &= m - 1)
+        {
+            int t = __builtin_ctz (m);
+            int tlen = terms[t].len;
+            if (i > len - tlen)
+                continue;
+
+            __m128i end = _mm_loadu_si128 ((const __m128i *) (buf + i + tlen - 1));
+            unsigned bits = _mm_movemask_epi8 (_mm_and_si128
+             (_mm_cmpeq_epi8 (block, first[t]), _mm_cmpeq_epi8 (end, last[t])));
+
+            for (; bits; bits &= bits - 1)
+            {
+                if (check_middle (buf + i + __builtin_ctz (bits), terms[t]))
+                {
+                    found |= 1u << t;
+                    mask &= ~(1u << t);
+                    break;
+                }
+            }
+        }
+    }
+
+    return found;
+}
+
+__attribute__ ((target ("avx2")))
+static unsigned match_avx2 (char * buf, int len, const Term * terms, unsigned mask)
+{
+    const __m256i bias = _mm256_set1_epi8 ((char) (0x80 - 'A'));
+    const __m256i limit = _mm256_set1_epi8 ((char) (-0x80 + 26));
+    const __m256i lower = _mm256_set1_epi8 (0x20);
+
+    for (int i = 0; i < len; i += 32)
+    {
+        __m256i c = _mm256_load_si256 ((const __m256i *) (buf + i));
+        __m256i upper = _mm256_cmpgt_epi8 (limit, _mm256_add_epi8 (c, bias));
+        _mm256_store_si256 ((__m256i *) (buf + i), _mm256_or_si256 (c, _mm256_and_si256 (upper, lower)));
+    }
+
+    __m256i first[TermMatcher::max_terms], last[TermMatcher::max_terms];
+    for (unsigned m = mask; m; m &= m - 1)
+    {
+        int t = __builtin_ctz (m);
+        first[t] = _mm256_set1_epi8 (terms[t].str[0]);
+        last[t] = _mm256_set1_epi8 (terms[t].str[terms[t].len - 1]);
+    }
+
+    unsigned found = 0;
+
+    for (int i = 0; i < len && mask; i += 32)
+    {
+        __m256i block = _mm256_load_si256 ((const __m256i *) (buf + i));
+
+        for (unsigned m = mask; m; m &= m - 1)
+        {
+            int t = __builtin_ctz (m);
+            int tlen = terms[t].len;
+            if (i > len - tlen)
+                continue;
+
+            __m256i end = _mm256_loadu_si256 ((const __m256i *) (buf + i + tlen - 1));
+            unsigned bits = _mm256_movemask_epi8 (_mm256_and_si256
+             (_mm256_cmpeq_epi8 (block, first[t]), _mm256_cmpeq_epi8 (end, last[t])));
+
+            for (; bits; bits &= bits - 1)
+            {
+                if (check_middle (buf + i + __builtin_ctz (bits), terms[t]))
+                {
+                    found |= 1u << t;
+                    mask &= ~(1u << t);
+                    break;
+                }
+            }
+        }
+    }
+
+    return found;
+}
+
+#endif // USE_X86
+
+#ifdef USE_NEON
+
+static unsigned match_neon (char * buf, int len, const Term * terms, unsigned mask)
+{
+    auto ubuf = (uint8_t *) buf;
+
+    for (int i = 0; i < len; i += 16)
+    {
+        uint8x16_t c = vld1q_u8 (ubuf + i);
+        uint8x16_t upper = vcltq_u8 (vsubq_u8 (c, vdupq_n_u8 ('A')), vdupq_n_u8 (26));
+        vst1q_u8 (ubuf + i, vorrq_u8 (c, vandq_u8 (upper, vdupq_n_u8 (0x20))));
+    }
+
+    unsigned found = 0;
+
+    for (int i = 0; i < len && mask; i += 16)
+    {
+        uint8x16_t block = vld1q_u8 (ubuf + i);
+
+        for (unsigned m = mask; m; m &= m - 1)
+        {
+            int t = __builtin_ctz (m);
+            int tlen = terms[t].len;
+            if (i > len - tlen)
+                continue;
+
+            uint8x16_t end = vld1q_u8 (ubuf + i + tlen - 1);
+            uint8x16_t eq = vandq_u8 (vceqq_u8 (block, vdupq_n_u8 (terms[t].str[0])),
+             vceqq_u8 (end, vdupq_n_u8 (terms[t].str[tlen - 1])));
+
+            /* narrow to four bits per byte to get a scalar mask */
+            uint64_t bits = vget_lane_u64 (vreinterpret_u64_u8
+             (vshrn_n_u16 (vreinterpretq_u16_u8 (eq), 4)), 0);
+
+            for (; bits; bits &= ~(uint64_t) 0xf << (__builtin_ctzll (bits) & ~3))
+            {
+                if (check_middle (buf + i + __builtin_ctzll (bits) / 4, terms[t]))
+                {
+                    found |= 1u << t;
+                    mask &= ~(1u << t);
+                    break;
+                }
+            }
+        }
+    }
+
+    return found;
+}
+
+#endif // USE_NEON
+
+static MatchFunc choose_kernel ()
+{
+#if defined(USE_X86)
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx2"))
+        return match_avx2;
+    return match_sse2;
+#elif defined(USE_NEON)
+    return match_neon;
+#else
+    return match_scalar;
+#endif
+}
+
+static const MatchFunc s_kernel = choose_kernel ();
+
+void TermMatcher::add (const char * term)
+{
+    if (m_count < max_terms)
+        m_terms[m_count ++] = {term, (int) strlen (term)};
+}
+
+unsigned TermMatcher::match (const char * name, unsigned mask) const
+{
+    int len = strlen (name);
+    unsigned found = 0;
+
+    /* empty terms match anything, overlong ones nothing */
+    for (unsigned m = mask; m; m &= m - 1)
+    {
+        int t = __builtin_ctz (m);
+        if (! m_terms[t].len)
+            found |= 1u << t;
+        if (! m_terms[t].len || m_terms[t].len > len)
+            mask &= ~(1u << t);
+    }
+
+    if (! mask)
+        return found;
+
+    if (len > max_name)
+        return found | match_scalar ((char *) name, len, m_terms, mask);
+
+    alignas (32) char buf[max_name + padding];
+    memcpy (buf, name, len);
+    memset (buf + len, 0, padding);
+
+    return found | s_kernel (buf, len, m_terms, mask);
+}
@@ -0,0 +1,65 @@
+/*
+ * name-match.h
+ * Copyright 2026 Zineffable1
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+#ifndef NAMEMATCH_H
+#define NAMEMATCH_H
+
+static inline unsigned char fold_ascii (unsigned char c)
+    { return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c; }
+
+// true if <str> contains no bytes outside of 7-bit ASCII
+bool is_ascii (const char * str);
+
+// Like strstr (), but folds ASCII upper case in <name> on the fly.  <term>
+// must already be lower case.
+bool contains_folded (const char * name, const char * term);
+
+// Returns 2 if <name> equals <term>, 1 if it starts with it, 0 otherwise,
+// folding ASCII upper case in <name> as above.
+int start_folded (const char * name, const char * term);
+
+// Matches a set of up to 32 lower-case terms against a name in a single
+// pass, folding ASCII upper case in the name on the fly.  Uses SSE2, AVX2
+// or NEON where available, chosen at runtime.  The terms are not copied.
+class TermMatcher
+{
+public:
+    static constexpr int max_terms = 32;
+
+    // terms beyond max_terms are ignored
+    void add (const char * term);
+
+    int count () const { return m_count; }
+    unsigned all () const
+        { return (m_count == max_terms) ? ~0u : (1u << m_count) - 1; }
+
+    // Returns the subset of the terms in <mask> that <name> contains.
+    unsigned match (const char * name, unsigned mask) const;
+
+    struct Term {
+        const char * str;
+        int len;
+    };
+
+private:
+    int m_count = 0;
+    Term m_terms[max_terms];
+};
+
+#endif // NAMEMATCH_H
@@ -0,0 +1,134 @@
+/*
+ * path-set.cc
+ * Copyright 2026 Zineffable1
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+#include "path-set.h"
+
+#include <string.h>
+
+// room for this many files the playlist doesn't have, beyond twice the
+// number of those it has, before the table has to grow
+static constexpr int spare_slots = 16384;
+
+uint64_t PathSet::hash_of (const char * filename)
+{
+    // FNV-1a, never 0, which marks a free slot
+    uint64_t hash = 0xcbf29ce484222325;
+    for (const char * c = filename; * c; c ++)
+        hash = (hash ^ (unsigned char) * c) * 0x100000001b3;
+
+    return hash ? hash : 1;
+}
+
+void PathSet::reset (int entries)
+{
+    uint32_t size = 1;
+    while (size < (uint32_t) entries * 2 + spare_slots)
+        size <<= 1;
+
+    m_slots.reset (new Slot[size]);
+    m_mask = size - 1;
+    m_names.clear ();
+    m_names.reserve (entries);
+    m_entries = m_found = 0;
+}
+
+void PathSet::clear ()
+{
+    m_slots.reset ();
+    m_mask = 0;
+    m_names.clear ();
+    m_entries = m_found = 0;
+}
+
+/* Moves the slots into a table of <size> (a power of two).  The names stay
+ * where they are. */
+void PathSet::resize (uint32_t size)
+{
+    std::unique_ptr<Slot[]> old = std::move (m_slots);
+    uint32_t old_size = m_mask + 1;
+
+    m_slots.reset (new Slot[size]);
+    m_mask = size - 1;
+
+    for (uint32_t i = 0; i < old_size; i ++)
+    {
+        if (old[i].hash)
+            find (old[i].hash, old[i].name) = old[i];
+    }
+}
+
+/* The slot holding <filename>, or the free one where it would go. */
+PathSet::Slot & PathSet::find (uint64_t hash, const char * filename)
+{
+    for (uint32_t i = hash & m_mask;; i = (i + 1) & m_mask)
+    {
+        auto & slot = m_slots[i];
+        if (! slot.hash || (slot.hash == hash && ! strcmp (slot.name, filename)))
+            return slot;
+    }
+}
+
+void PathSet::add (Slot & slot, uint64_t hash, String && filename, int entry)
+{
+    slot.hash = hash;
+    slot.name = filename;
+    slot.entry = entry;
+    m_names.append (std::move (filename));
+
+    // keep at least a quarter free, so that probes stay short
+    if ((uint32_t) m_names.len () > (m_mask + 1) / 4 * 3)
+        resize ((m_mask + 1) * 2);
+}
+
+bool PathSet::add_entry (const String & filename, int entry)
+{
+    uint64_t hash = hash_of (filename);
+    Slot & slot = find (hash, filename);
+
+    if (slot.hash)
+        return false;
+
+    add (slot, hash, String (filename), entry);
+    m_entries ++;
+    return true;
+}
+
+bool PathSet::check (const char * filename)
+{
+    if (! m_slots)
+        return true;
+
+    uint64_t hash = hash_of (filename);
+    Slot & slot = find (hash, filename);
+
+    // new to the playlist, and to this scan
+    if (! slot.hash)
+    {
+        add (slot, hash, String (filename), -1);
+        return true;
+    }
+
+    if (slot.entry >= 0 && ! slot.found)
+    {
+        slot.found = true;
+        m_found ++;
+    }
+
+    return false;
+}
@@ -0,0 +1,87 @@
+/*
+ * path-set.h
+ * Copyright 2026 Zineffable1
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+#ifndef PATH_SET_H
+#define PATH_SET_H
+
+#include <memory>
+#include <stdint.h>
+
+#include <libaudcore/index.h>
+#include <libaudcore/objects.h>
+
+// The filenames of a playlist, for telling which files found by a scan are
+// new.  The set is filled on the main thread before the scan and then
+// probed by the add thread, which is the only one to touch it until the
+// scan is complete.  The probe hashes the name in place, so nothing is
+// allocated for the files the playlist has already.  The files the scan
+// finds that the playlist doesn't have are added as well, so that a file
+// reached twice (through a symlink, say) is added only once.
+class PathSet
+{
+public:
+    // <entries> is the number of add_entry () calls to follow
+    void reset (int entries);
+    void clear ();
+
+    // before the scan; returns false if the filename is already there (the
+    // playlist has it twice)
+    bool add_entry (const String & filename, int entry);
+
+    // during the scan; returns true if the file is new
+    bool check (const char * filename);
+
+    // after the scan: calls func (entry, name) for each entry the scan
+    // didn't find; the number is as of add_entry ()
+    template<class F>
+    void for_each_missing (F func) const
+    {
+        for (uint32_t i = 0; i <= m_mask; i ++)
+        {
+            auto & slot = m_slots[i];
+            if (slot.entry >= 0 && ! slot.found)
+                func (slot.entry, slot.name);
+        }
+    }
+
+    int n_entries () const { return m_entries; }
+    int n_found () const { return m_found; }
+
+private:
+    struct Slot
+    {
+        uint64_t hash = 0;             // 0 for a free slot
+        const char * name = nullptr;
+        int entry = -1;                // -1 for files found by the scan
+        bool found = false;
+    };
+
+    static uint64_t hash_of (const char * filename);
+    void resize (uint32_t size);
+    Slot & find (uint64_t hash, const char * filename);
+    void add (Slot & slot, uint64_t hash, String && filename, int entry);
+
+    std::unique_ptr<Slot[]> m_slots;
+    uint32_t m_mask = 0;
+    Index<String> m_names;             // keeps the names alive
+
+    int m_entries = 0, m_found = 0;
+};
+
+#endif // PATH_SET_H
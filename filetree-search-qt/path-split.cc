@@ -0,0 +1,148 @@
+/*
+ * path-split.cc
+ * Copyright 2026 Zineffable1
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+#include "path-split.h"
+
+#include <string.h>
+
+#include <QString>
+
+static int hex_value (char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+
+    return -1;
+}
+
+// true if the bytes are well-formed UTF-8 (overlong forms and surrogates
+// aside, which QString lets through as well)
+static bool valid_utf8 (const char * str, int len)
+{
+    auto s = (const unsigned char *) str;
+    auto end = s + len;
+
+    while (s < end)
+    {
+        if (* s < 0x80)
+        {
+            s ++;
+            continue;
+        }
+
+        int follow = (* s >= 0xf0 && * s < 0xf8) ? 3 :
+         (* s >= 0xe0) ? 2 : (* s >= 0xc2) ? 1 : -1;
+
+        if (follow < 0 || * s >= 0xf8 || end - s <= follow)
+            return false;
+
+        for (int i = 1; i <= follow; i ++)
+        {
+            if ((s[i] & 0xc0) != 0x80)
+                return false;
+        }
+
+        s += follow + 1;
+    }
+
+    return true;
+}
+
+// Percent-decodes <uri> into <buf>, leaving out the "file://" prefix.
+// Malformed escapes are kept as they are, like QUrl::fromPercentEncoding ()
+// does.
+void PathSplitter::decode (const char * uri, Index<char> & buf)
+{
+    if (! strncmp (uri, "file://", 7))
+        uri += 7;
+
+    int len = strlen (uri);
+    buf.clear ();
+    buf.insert (0, len);
+
+    char * out = buf.begin ();
+    for (const char * c = uri; * c; c ++)
+    {
+        int high, low;
+        if (* c == '%' && (high = hex_value (c[1])) >= 0 && (low = hex_value (c[2])) >= 0)
+        {
+            * out ++ = (char) (high << 4 | low);
+            c += 2;
+        }
+        else
+            * out ++ = * c;
+    }
+
+    int decoded = out - buf.begin ();
+    buf.remove (decoded, len - decoded);
+}
+
+PathSplitter::PathSplitter (const char * base_uri)
+{
+    if (! base_uri)
+        return;
+
+    decode (base_uri, m_base);
+
+    if (m_base.len () && m_base[m_base.len () - 1] == '/')
+        m_base.remove (m_base.len () - 1, 1);
+}
+
+bool PathSplitter::split (const char * uri)
+{
+    decode (uri, m_buf);
+    m_parts.clear ();
+    m_fixed.clear ();
+
+    const char * path = m_buf.begin ();
+    const char * end = path + m_buf.len ();
+
+    bool below = ! m_base.len () || (m_buf.len () > m_base.len () &&
+     ! memcmp (path, m_base.begin (), m_base.len ()) && path[m_base.len ()] == '/');
+
+    if (below && m_base.len ())
+        path += m_base.len () + 1;
+
+    while (path < end)
+    {
+        auto slash = (const char *) memchr (path, '/', end - path);
+        int len = (slash ? slash : end) - path;
+
+        if (len)
+        {
+            if (valid_utf8 (path, len))
+                m_parts.append ({path, len});
+            else
+            {
+                // as the QString conversion would: with U+FFFD for bad bytes
+                m_fixed.append (String (QString::fromUtf8 (path, len).toUtf8 ()));
+                auto & fixed = m_fixed[m_fixed.len () - 1];
+                m_parts.append ({(const char *) fixed, (int) strlen (fixed)});
+            }
+        }
+
+        path += len + 1;
+    }
+
+    return below;
+}
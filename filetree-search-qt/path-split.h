@@ -0,0 +1,58 @@
+/*
+ * path-split.h
+ * Copyright 2026 Zineffable1
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+#ifndef PATH_SPLIT_H
+#define PATH_SPLIT_H
+
+#include <libaudcore/index.h>
+#include <libaudcore/objects.h>
+
+// Splits the URIs of playlist entries into their decoded path components
+// below a base folder, without going through QString.  Each URI is
+// percent-decoded into a buffer that is kept from one call to the next, and
+// the components point into it, so once the buffer has grown to the longest
+// path, splitting allocates nothing.  A splitter is meant for one thread.
+class PathSplitter
+{
+public:
+    // <base_uri> is the library's URI, or null for none
+    explicit PathSplitter (const char * base_uri);
+
+    struct Part {
+        const char * str;   // not NUL-terminated
+        int len;
+    };
+
+    // Splits <uri> and returns whether it is below the base folder; the
+    // path is split in full if it isn't.  Empty components are skipped.
+    bool split (const char * uri);
+
+    // valid until the next split ()
+    const Index<Part> & parts () const { return m_parts; }
+
+private:
+    static void decode (const char * uri, Index<char> & buf);
+
+    Index<char> m_base;     // decoded, without "file://" or a trailing slash
+    Index<char> m_buf;
+    Index<Part> m_parts;
+    Index<String> m_fixed;  // components that weren't valid UTF-8
+};
+
+#endif // PATH_SPLIT_H
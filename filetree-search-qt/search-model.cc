@@ -19,12 +19,24 @@
 
 #include "search-model.h"
 
+#include <algorithm>
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
 #include <QMimeData>
-#include <QSet>
 #include <QUrl>
 
 #include <libaudcore/i18n.h>
 
+#include "path-split.h"
+
+/* Rows are handed to the view in pages of this size, so that a folder with
+ * a huge number of visible children does not have to be laid out at once. */
+static constexpr int fetch_page = 500;
+
 static QString create_item_label (const Item & item)
 {
     QString string;
@@ -49,14 +61,14 @@ static QString create_item_label (const Item & item)
 
     if (item.field != SearchField::Title)
     {
-        // Only show song count for items that actually have songs
-        if (item.matches.len() > 0)
+        // Show the number of songs anywhere below the folder
+        if (item.n_entries > 0)
         {
             extra_info += str_printf (dngettext (PACKAGE, "%d song", "%d songs",
-             item.matches.len ()), item.matches.len ());
+             item.n_entries), item.n_entries);
             has_extra = true;
 
-            if (item.field == SearchField::Genre || item.parent)
+            if ((item.field == SearchField::Genre && item.matches.len() > 0) || item.parent)
                 extra_info += ' ';
         }
     }
@@ -114,7 +126,13 @@ QVariant SearchModel::data (const QModelIndex & index, int role) const
         if (!item)
             return QVariant ();
 
-        return create_item_label (* item);
+        // Items don't change while the database lives, so neither do labels
+        if (const QString * label = m_labels.object (item))
+            return * label;
+
+        QString label = create_item_label (* item);
+        m_labels.insert (item, new QString (label));
+        return label;
     }
 
     return QVariant ();
@@ -123,19 +141,13 @@ QVariant SearchModel::data (const QModelIndex & index, int role) const
 int SearchModel::rowCount (const QModelIndex & parent) const
 {
     if (!parent.isValid())
-        return m_root_items.len();
+        return m_roots_shown;
     
     const Item * item = item_at_index(parent);
     if (!item)
         return 0;
     
-    // Count only visible children
-    int count = 0;
-    const_cast<SimpleHash<Key, Item>&>(item->children).iterate([&](const Key &, Item & child) {
-        if (child.m_search_visible)
-            count++;
-    });
-    return count;
+    return item->shown;
 }
 
 QModelIndex SearchModel::parent (const QModelIndex & index) const
@@ -144,31 +156,11 @@ QModelIndex SearchModel::parent (const QModelIndex & index) const
         return QModelIndex();
     
     const Item * item = static_cast<Item *>(index.internalPointer());
-    if (!item || !item->parent)
+    if (!item || !item->parent || item->parent->row < 0)
         return QModelIndex();
     
-    Item * parent = item->parent;
-    if (!parent->parent)
-    {
-        for (int row = 0; row < m_root_items.len(); row++)
-        {
-            if (m_root_items[row] == parent)
-                return createIndex(row, 0, parent);
-        }
-    }
-    else
-    {
-        Item * grandparent = parent->parent;
-        int row = 0;
-        const_cast<SimpleHash<Key, Item>&>(grandparent->children).iterate([&](const Key &, Item & child) {
-            if (&child == parent)
-                return;
-            row++;
-        });
-        return createIndex(row, 0, parent);
-    }
-    
-    return QModelIndex();
+    // The row is kept up to date by build_visible()
+    return createIndex(item->parent->row, 0, item->parent);
 }
 
 QModelIndex SearchModel::index (int row, int column, const QModelIndex & parent) const
@@ -178,7 +170,7 @@ QModelIndex SearchModel::index (int row, int column, const QModelIndex & parent)
     
     if (!parent.isValid())
     {
-        if (row < 0 || row >= m_root_items.len())
+        if (row < 0 || row >= m_roots_shown)
             return QModelIndex();
         return createIndex(row, 0, m_root_items[row]);
     }
@@ -187,21 +179,10 @@ QModelIndex SearchModel::index (int row, int column, const QModelIndex & parent)
     if (!parent_item)
         return QModelIndex();
     
-    // Get visible children in sorted order
-    Index<Item *> children;
-    const_cast<SimpleHash<Key, Item>&>(parent_item->children).iterate([&](const Key &, Item & item) {
-        if (item.m_search_visible)
-            children.append(&item);
-    });
-    
-    children.sort([](Item * const & a, Item * const & b) {
-        return str_compare(a->name, b->name) > 0;
-    });
-    
-    if (row < 0 || row >= (int)children.len())
+    if (row < 0 || row >= parent_item->shown)
         return QModelIndex();
     
-    return createIndex(row, 0, children[row]);
+    return createIndex(row, 0, parent_item->visible[row]);
 }
 
 bool SearchModel::hasChildren (const QModelIndex & parent) const
@@ -213,296 +194,1667 @@ bool SearchModel::hasChildren (const QModelIndex & parent) const
     if (!item)
         return false;
     
-    // Check if there are any visible children
-    bool has_visible = false;
-    const_cast<SimpleHash<Key, Item>&>(item->children).iterate([&](const Key &, Item & child) {
-        if (child.m_search_visible)
-            has_visible = true;
-    });
-    return has_visible;
+    return item->visible.len() > 0;
 }
 
-QMimeData * SearchModel::mimeData (const QModelIndexList & indexes) const
+bool SearchModel::canFetchMore (const QModelIndex & parent) const
 {
-    m_playlist.select_all (false);
+    if (!parent.isValid())
+        return m_roots_shown < m_root_items.len();
 
-    QList<QUrl> urls;
-    QSet<int> seen_entries;  // Track unique entries to avoid duplicates
-    
-    // Recursive function to collect all files in folders
-    std::function<void(const Item *)> collect_files = [&](const Item * folder) {
-        // Get children and sort them
-        Index<Item *> children;
-        const_cast<SimpleHash<Key, Item>&>(folder->children).iterate([&](const Key &, Item & child) {
-            children.append(&child);
-        });
-        
-        children.sort([](Item * const & a, Item * const & b) {
-            return str_compare(a->name, b->name) > 0;
-        });
-        
-        // Process in sorted order
-        for (auto child : children)
-        {
-            if (child->field == SearchField::Title && child->matches.len() > 0)
-            {
-                // This is a file - add each entry if not already seen
-                for (int entry : child->matches)
-                {
-                    if (!seen_entries.contains(entry))
-                    {
-                        seen_entries.insert(entry);
-                        urls.append (QString (m_playlist.entry_filename (entry)));
-                        m_playlist.select_entry (entry, true);
-                    }
-                }
-            }
-            else if (child->children.n_items() > 0)
-            {
-                // This is a subfolder, recurse
-                collect_files(child);
-            }
-        }
-    };
-    
-    for (auto & index : indexes)
+    const Item * item = item_at_index(parent);
+    return item && item->shown < item->visible.len();
+}
+
+void SearchModel::fetchMore (const QModelIndex & parent)
+{
+    Item * item = parent.isValid() ? static_cast<Item *>(parent.internalPointer()) : nullptr;
+    int & shown = item ? item->shown : m_roots_shown;
+    int total = item ? item->visible.len() : m_root_items.len();
+
+    int count = aud::min(total - shown, fetch_page);
+    if (count <= 0)
+        return;
+
+    beginInsertRows(parent, shown, shown + count - 1);
+    shown += count;
+    endInsertRows();
+}
+
+QModelIndexList SearchModel::expansion (int budget) const
+{
+    QModelIndexList indexes;
+
+    // Breadth-first, so that shallow folders are expanded before deep ones
+    Index<Item *> queue;
+    for (int r = 0; r < m_roots_shown; r ++)
+        queue.append (m_root_items[r]);
+
+    int rows = m_roots_shown;
+
+    for (int i = 0; i < queue.len (); i ++)
     {
-        const Item * item = item_at_index(index);
-        if (!item)
+        Item * item = queue[i];
+
+        // A folder has visible children because matches lie below it,
+        // except below a match of the whole path, which shows everything
+        if (! item->shown || (m_match_all && item->m_search_match))
             continue;
 
-        // Check if this is a file or a folder
-        if (item->field == SearchField::Title && item->matches.len() > 0)
+        if (rows + item->shown > budget)
+            break;
+
+        rows += item->shown;
+        indexes.append (createIndex (item->row, 0, item));
+
+        for (int r = 0; r < item->shown; r ++)
+            queue.append (item->visible[r]);
+    }
+
+    return indexes;
+}
+
+struct EntryRange
+{
+    int first, last;
+};
+
+/* Adds the entries below <item> as ranges, walking down only where they
+ * are not contiguous. */
+static void add_entry_ranges (const Item * item, Index<EntryRange> & ranges)
+{
+    if (! item->n_entries)
+        return;
+
+    if (item->entries_contiguous ())
+    {
+        ranges.append (EntryRange {item->first_entry, item->last_entry});
+        return;
+    }
+
+    for (int entry : item->matches)
+        ranges.append (EntryRange {entry, entry + 1});
+    for (const Item * child : item->sorted)
+        add_entry_ranges (child, ranges);
+}
+
+/* The entries below the items at <indexes>, as sorted ranges that don't
+ * overlap, since a folder and something inside it may both be selected. */
+static void collect_ranges (const SearchModel & model,
+ const QModelIndexList & indexes, Index<EntryRange> & ranges)
+{
+    for (auto & index : indexes)
+    {
+        const Item * item = model.item_at_index(index);
+        if (item)
+            add_entry_ranges (item, ranges);
+    }
+
+    std::sort (ranges.begin (), ranges.end (),
+     [] (const EntryRange & a, const EntryRange & b) { return a.first < b.first; });
+
+    int merged = 0;
+    for (auto & range : ranges)
+    {
+        if (merged && range.first <= ranges[merged - 1].last)
+            ranges[merged - 1].last = aud::max (ranges[merged - 1].last, range.last);
+        else
+            ranges[merged ++] = range;
+    }
+
+    ranges.remove (merged, ranges.len () - merged);
+}
+
+void SearchModel::collect_entries (const QModelIndexList & indexes, Index<int> & entries) const
+{
+    Index<EntryRange> ranges;
+    collect_ranges (* this, indexes, ranges);
+
+    for (auto & range : ranges)
+    {
+        for (int entry = range.first; entry < range.last; entry ++)
+            entries.append (entry);
+    }
+}
+
+/* Drag data that holds only the entry ranges of the dragged items.  The
+ * text/uri-list is put together when the drop target first asks for it, and
+ * a target that wants the URLs as such (as Audacious playlists do) gets them
+ * without a round trip through text. */
+class EntryMimeData : public QMimeData
+{
+public:
+    EntryMimeData (Playlist playlist, Index<EntryRange> && ranges) :
+        m_playlist (playlist),
+        m_ranges (std::move (ranges)) {}
+
+    QStringList formats () const override
+        { return QStringList ("text/uri-list"); }
+    bool hasFormat (const QString & type) const override
+        { return type == "text/uri-list"; }
+
+protected:
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+    QVariant retrieveData (const QString & type, QMetaType want) const override
+    {
+        bool as_list = (want.id () == QMetaType::QVariantList);
+#else
+    QVariant retrieveData (const QString & type, QVariant::Type want) const override
+    {
+        bool as_list = (want == QVariant::List);
+#endif
+        if (type != "text/uri-list" || ! m_playlist.exists ())
+            return QVariant ();
+
+        if (! m_done)
+            materialize ();
+
+        return as_list ? QVariant (m_urls) : QVariant (m_text);
+    }
+
+private:
+    void materialize () const;
+
+    Playlist m_playlist;
+    Index<EntryRange> m_ranges;
+
+    mutable bool m_done = false;
+    mutable QVariantList m_urls;
+    mutable QByteArray m_text;
+};
+
+void EntryMimeData::materialize () const
+{
+    StopWatch timer ("Listing the dragged files");
+    int entries = m_playlist.n_entries ();
+
+    // Let the playlist the files are dropped on reuse their metadata.
+    // That needs them selected, so the selection the Library playlist had
+    // is put back afterwards.
+    Index<int> selected;
+    if (m_playlist.n_selected ())
+    {
+        for (int entry = 0; entry < entries; entry ++)
         {
-            // This is a single file - add it directly
-            for (int entry : item->matches)
-            {
-                if (!seen_entries.contains(entry))
-                {
-                    seen_entries.insert(entry);
-                    urls.append (QString (m_playlist.entry_filename (entry)));
-                    m_playlist.select_entry (entry, true);
-                }
-            }
+            if (m_playlist.entry_selected (entry))
+                selected.append (entry);
         }
-        else if (item->children.n_items() > 0)
+    }
+
+    m_playlist.select_all (false);
+
+    for (auto & range : m_ranges)
+    {
+        // the playlist may have shrunk since the drag started
+        for (int entry = range.first; entry < aud::min (range.last, entries); entry ++)
         {
-            // This is a folder - recursively collect all files
-            collect_files(item);
+            String filename = m_playlist.entry_filename (entry);
+            m_urls.append (QUrl::fromEncoded (QByteArray (filename)));
+            m_text.append (filename);
+            m_text.append ("\r\n");
+            m_playlist.select_entry (entry, true);
         }
     }
 
     m_playlist.cache_selected ();
 
-    auto data = new QMimeData;
-    data->setUrls (urls);
-    return data;
+    m_playlist.select_all (false);
+    for (int entry : selected)
+        m_playlist.select_entry (entry, true);
+
+    m_done = true;
+}
+
+QMimeData * SearchModel::mimeData (const QModelIndexList & indexes) const
+{
+    // Not until a snapshot has been matched up with the playlist
+    if (! m_playlist.exists ())
+        return nullptr;
+
+    Index<EntryRange> ranges;
+    collect_ranges (* this, indexes, ranges);
+    return new EntryMimeData (m_playlist, std::move (ranges));
 }
 
 void SearchModel::update ()
 {
     beginResetModel();
-    build_root_items();
     endResetModel();
 }
 
-void SearchModel::build_root_items()
+/* Rebuilds the list of visible items from the list of all items, keeping
+ * the display order.  Each item's row is updated to match its position in
+ * the new list (or -1 if hidden) so that parent() can look it up directly.
+ * Returns how many of them to show before the view fetches more. */
+template<class List>
+static int build_visible (const ArenaArray<Item *> & sorted, List & visible)
 {
-    m_root_items.clear();
-    m_database.iterate([&](const Key &, Item & item) {
-        m_root_items.append(&item);
-    });
-    
-    // Sort alphabetically
-    m_root_items.sort([](Item * const & a, Item * const & b) {
-        return str_compare(a->name, b->name) > 0;
-    });
+    visible.clear ();
+    for (Item * item : sorted)
+    {
+        if (item->m_search_visible)
+        {
+            item->row = visible.len ();
+            visible.append (item);
+        }
+        else
+            item->row = -1;
+    }
+
+    return aud::min (visible.len (), fetch_page);
 }
 
-void SearchModel::destroy_database ()
+/* Writes the form of a name that strcmp () puts in the order of
+ * str_compare (): ASCII upper case is folded, and each run of digits becomes
+ * '0', one more than the number of significant digits, and those digits, so
+ * that a longer number sorts after a shorter one.  It is worked out once per
+ * item, so that sorting never has to parse the numbers.  Returns the length;
+ * the key is not NUL-terminated. */
+static int sort_key (const char * name, int len, Index<char> & buf)
 {
-    m_playlist = Playlist ();
-    m_root_items.clear ();
-    m_hidden_items = 0;
-    m_database.clear ();
+    buf.clear ();
+    buf.insert (0, 3 * len);
+
+    const char * end = name + len;
+    char * out = buf.begin ();
+
+    for (const char * c = name; c < end; )
+    {
+        if (* c < '0' || * c > '9')
+        {
+            * out ++ = fold_ascii (* c ++);
+            continue;
+        }
+
+        const char * digits = c;
+        while (digits < end && * digits == '0')
+            digits ++;
+        for (c = digits; c < end && * c >= '0' && * c <= '9'; )
+            c ++;
+
+        // numbers too long for the count (which str_compare () would
+        // overflow on anyway) go in pieces
+        int left = c - digits;
+        do
+        {
+            int n = aud::min (left, 254);
+            * out ++ = '0';
+            * out ++ = (char) (n + 1);
+            memcpy (out, digits, n);
+            out += n;
+            digits += n;
+            left -= n;
+        }
+        while (left);
+    }
+
+    return out - buf.begin ();
 }
 
-void SearchModel::add_to_database (int entry, std::initializer_list<Key> keys)
+/* Display order of two items.  Only identical items compare equal, so that
+ * sorted lists can be merged. */
+static int item_order (const Item * a, const Item * b)
 {
-    Item * parent = nullptr;
-    auto hash = & m_database;
+    int val = strcmp (a->key, b->key);
+    if (! val)
+        val = strcmp (a->name, b->name);
+    if (! val)
+        val = (int) a->field - (int) b->field;
+
+    return val;
+}
 
-    for (auto & key : keys)
+/* Sorts the children of each of <items>, recursively, and sets up their
+ * visible lists.  This is done once per database so that the model never
+ * has to sort anything while Qt is querying it. */
+static void sort_children (Arena & arena, const ArenaArray<Item *> & items)
+{
+    for (Item * item : items)
     {
-        if (! key.name)
-            continue;
+        std::sort (item->sorted.begin (), item->sorted.end (),
+         [] (const Item * a, const Item * b) { return item_order (a, b) < 0; });
 
-        Item * item = hash->lookup (key);
-        if (! item)
-            item = hash->add (key, Item (key.field, key.name, parent));
+        item->visible.reserve (arena, item->sorted.len ());
+        item->shown = build_visible (item->sorted, item->visible);
 
-        item->matches.append (entry);
+        sort_children (arena, item->sorted);
+    }
+}
 
-        parent = item;
-        hash = & item->children;
+/* Sets up the visible lists for children that are in display order already. */
+static void init_visible (Arena & arena, const ArenaArray<Item *> & items)
+{
+    for (Item * item : items)
+    {
+        item->visible.reserve (arena, item->sorted.len ());
+        item->shown = build_visible (item->sorted, item->visible);
+
+        init_visible (arena, item->sorted);
     }
 }
 
-void SearchModel::create_database (Playlist playlist, const String & base_path)
+/* Numbers the items in display order (parents before children), adds
+ * their names to the trigram index and sums up the entries below them. */
+static void index_items (Database & db, const ArenaArray<Item *> & items)
 {
-    destroy_database ();
+    for (Item * item : items)
+    {
+        item->id = db.items.len ();
+        db.items.append (item);
+        db.trigrams.add (item->id, item->folded ? item->folded : item->name);
 
-    int entries = playlist.n_entries ();
-    
-    // Convert base_path (URI) to proper format
-    QString base_dir;
-    if (base_path)
-    {
-        base_dir = QString::fromUtf8((const char *)base_path);
-        base_dir = QUrl::fromPercentEncoding(base_dir.toUtf8());
-        
-        // Remove file:// prefix if present
-        if (base_dir.startsWith("file://"))
-            base_dir = base_dir.mid(7);
-        
-        // Ensure it doesn't end with /
-        if (base_dir.endsWith("/"))
-            base_dir.chop(1);
+        index_items (db, item->sorted);
+
+        // matches are in playlist order
+        if (item->matches.len ())
+        {
+            item->n_entries = item->matches.len ();
+            item->first_entry = item->matches[0];
+            item->last_entry = item->matches[item->matches.len () - 1] + 1;
+        }
+
+        for (const Item * child : item->sorted)
+        {
+            if (! child->n_entries)
+                continue;
+
+            if (! item->n_entries)
+            {
+                item->first_entry = child->first_entry;
+                item->last_entry = child->last_entry;
+            }
+            else
+            {
+                item->first_entry = aud::min (item->first_entry, child->first_entry);
+                item->last_entry = aud::max (item->last_entry, child->last_entry);
+            }
+
+            item->n_entries += child->n_entries;
+        }
     }
+}
 
-    for (int e = 0; e < entries; e ++)
+/* Build-time lookup of an item by its parent and name.  The names are
+ * interned in the builder's pool, so they are compared as pointers. */
+struct NodeKey
+{
+    const Item * parent;
+    const char * name;
+    SearchField field;
+
+    bool operator== (const NodeKey & b) const
+        { return parent == b.parent && name == b.name && field == b.field; }
+
+    unsigned hash () const
     {
-       String filename = playlist.entry_filename(e);
-if (! filename)
-    continue;
+        uint64_t h = (uint64_t) (uintptr_t) parent * 0x9e3779b97f4a7c15 ^
+         (uint64_t) (uintptr_t) name;
+        h ^= h >> 29;
+        h *= 0xbf58476d1ce4e5b9;
+        h ^= h >> 32;
+        return (unsigned) h + (unsigned) field;
+    }
+};
+
+/* Builds the tree for one chunk of entries.  Everything it allocates goes
+ * into its arena; the lookup tables are dropped once the build is done. */
+struct TreeBuilder
+{
+    Arena & arena;
+    StringPool pool;
+    SimpleHash<NodeKey, Item *> nodes;
+    ArenaArray<Item *> roots;
+    Index<char> key_buf;
 
-// convert to QString and decode spaces
-QString fullpath = QString::fromUtf8((const char *)filename);
-fullpath = QUrl::fromPercentEncoding(fullpath.toUtf8());
+    explicit TreeBuilder (Arena & arena) :
+        arena (arena),
+        pool (arena) {}
 
-// Remove file:// prefix if present
-if (fullpath.startsWith("file://"))
-    fullpath = fullpath.mid(7);
+    void add_path (const Index<PathSplitter::Part> & parts, int entry, int first = 0);
+};
 
-// Strip the base directory path
-if (!base_dir.isEmpty() && fullpath.startsWith(base_dir + "/"))
+/* Adds one playlist entry, given as path components, leaving out the first
+ * <first> of them. */
+void TreeBuilder::add_path (const Index<PathSplitter::Part> & parts, int entry, int first)
 {
-    fullpath = fullpath.mid(base_dir.length() + 1);
-}
+    Item * parent = nullptr;
+
+    for (int i = first; i < parts.len (); i ++)
+    {
+        // last component = file, others = folder
+        SearchField field = (i == parts.len () - 1) ? SearchField::Title : SearchField::Genre;
+        const char * name = pool.intern (parts[i].str, parts[i].len);
+
+        NodeKey key {parent, name, field};
+        Item * * found = nodes.lookup (key);
+        Item * item;
 
-QStringList parts = fullpath.split("/", Qt::SkipEmptyParts);
+        if (found)
+            item = * found;
+        else
+        {
+            const char * folded = nullptr;
+            if (! is_ascii (name))
+            {
+                StringBuf buf = str_tolower_utf8 (name);
+                folded = strcmp (buf, name) ? pool.intern (buf, buf.len ()) : name;
+            }
 
-Item * parent = nullptr;
-auto hash = &m_database;
+            int key_len = sort_key (name, parts[i].len, key_buf);
+            const char * sort_key_str = (key_len == parts[i].len &&
+             ! memcmp (key_buf.begin (), name, key_len)) ? name :
+             pool.intern (key_buf.begin (), key_len);
 
-for (int i = 0; i < parts.size(); ++i) {
-    QString part = parts[i];
-    String partStr(part.toUtf8());
+            item = arena.create<Item> (field, name, folded, sort_key_str, parent);
 
-    // last component = file, others = folder
-    SearchField field = (i == parts.size() - 1) ? SearchField::Title : SearchField::Genre;
+            nodes.add (key, (Item *) item);
+            (parent ? parent->sorted : roots).append (arena, item);
+        }
 
-    Key key { field, partStr };
+        // only append matches to the file node
+        if (field == SearchField::Title)
+            item->matches.append (arena, entry);
 
-    Item * item = hash->lookup(key);
-    if (!item)
-        item = hash->add(key, Item(field, partStr, parent));
+        parent = item;
+    }
+}
 
-    // only append matches to the file node
-    if (field == SearchField::Title)
-        item->matches.append(e);
+static ArenaArray<Item *> merge_items (Arena & arena, const ArenaArray<Item *> & a,
+ const ArenaArray<Item *> & b, Item * parent);
 
-    parent = item;
-    hash = &item->children;
+/* Merges <other> (from another tree) into <item>. */
+static void merge_item (Arena & arena, Item * item, Item * other)
+{
+    for (int entry : other->matches)
+        item->matches.append (arena, entry);
+
+    item->sorted = merge_items (arena, item->sorted, other->sorted, item);
+    item->visible.reserve (arena, item->sorted.len ());
+    item->shown = build_visible (item->sorted, item->visible);
 }
 
+/* Merges two sorted lists of items into a new one, allocated in <arena>.
+ * Items present in both lists are merged themselves; those only in <b>
+ * are moved under <parent>.  The entries in <b> must come after those in
+ * <a>, so that the match lists stay in playlist order. */
+static ArenaArray<Item *> merge_items (Arena & arena, const ArenaArray<Item *> & a,
+ const ArenaArray<Item *> & b, Item * parent)
+{
+    ArenaArray<Item *> merged;
+    merged.reserve (arena, a.len () + b.len ());
+
+    int i = 0, j = 0;
+    while (i < a.len () || j < b.len ())
+    {
+        int val = (i == a.len ()) ? 1 : (j == b.len ()) ? -1 : item_order (a[i], b[j]);
 
+        if (val < 0)
+            merged.append (a[i ++]);
+        else if (val > 0)
+        {
+            Item * item = b[j ++];
+            item->parent = parent;
+            merged.append (item);
+        }
+        else
+        {
+            Item * item = a[i ++];
+            merge_item (arena, item, b[j ++]);
+            merged.append (item);
+        }
     }
 
-    m_playlist = playlist;
+    return merged;
+}
+
+/* Runs func (0) ... func (count - 1), spread over up to <threads> threads. */
+template<class F>
+static void parallel_for (int count, int threads, F func)
+{
+    std::atomic<int> next (0);
+    auto worker = [&] () {
+        for (int i; (i = next ++) < count;)
+            func (i);
+    };
+
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; t ++)
+        pool.emplace_back (worker);
+
+    worker ();
+
+    for (auto & thread : pool)
+        thread.join ();
 }
 
+/* Number of threads worth starting for <work> units of work. */
+static int n_threads (int work, int min_per_thread)
+{
+    int cpus = std::max ((int) std::thread::hardware_concurrency (), 1);
+    return std::max (std::min (work / min_per_thread, cpus), 1);
+}
 
-static void search_recurse (SimpleHash<Key, Item> & domain,
- const Index<String> & terms, int mask, Index<const Item *> & results)
+void Database::build (const Index<String> & filenames, const String & base_path)
 {
-    domain.iterate ([&] (const Key & key, Item & item)
+    StopWatch timer;
+    int entries = filenames.len ();
+
+    /* Decode and insert contiguous chunks of entries into one tree per
+     * thread, each in its own arena, then merge the trees pairwise.  Since
+     * the Library playlist is sorted by path, the trees overlap only at the
+     * chunk boundaries. */
+    int threads = n_threads (entries, 2048);
+    Index<SmartPtr<TreeBuilder>> trees;
+
+    for (int t = 0; t < threads; t ++)
     {
-        int count = terms.len ();
-        int new_mask = mask;
+        arenas.append (new Arena);
+        trees.append (new TreeBuilder (* arenas[t]));
+    }
 
-        for (int t = 0, bit = 1; t < count; t ++, bit <<= 1)
+    parallel_for (threads, threads, [&] (int t) {
+        auto & tree = * trees[t];
+        PathSplitter splitter (base_path);
+        int end = (int64_t) entries * (t + 1) / threads;
+
+        for (int e = (int64_t) entries * t / threads; e < end; e ++)
         {
-            if (! (new_mask & bit))
-                continue; /* skip term if it is already found */
+            if (! filenames[e])
+                continue;
 
-            if (strstr (item.folded, terms[t]))
-                new_mask &= ~bit; /* we found it */
-            else if (! item.children.n_items ())
-                break; /* quit early if there are no children to search */
+            splitter.split (filenames[e]);
+            tree.add_path (splitter.parts (), e);
         }
 
-        /* adding an item with exactly one child is redundant, so avoid it */
-        if (! new_mask && item.children.n_items () != 1 &&
-         item.field != SearchField::HiddenAlbum)
-            results.append (& item);
-
-        search_recurse (item.children, terms, new_mask, results);
+        std::sort (tree.roots.begin (), tree.roots.end (),
+         [] (const Item * a, const Item * b) { return item_order (a, b) < 0; });
+        sort_children (tree.arena, tree.roots);
     });
+
+    for (int step = 1; step < threads; step *= 2)
+    {
+        int pairs = (threads - step + 2 * step - 1) / (2 * step);
+        parallel_for (pairs, pairs, [&] (int p) {
+            auto & a = * trees[2 * step * p], & b = * trees[2 * step * p + step];
+            a.roots = merge_items (a.arena, a.roots, b.roots, nullptr);
+        });
+    }
+
+    sorted_roots = trees[0]->roots;
+    index_items (* this, sorted_roots);
+
+    this->base_path = base_path;
+    build_ms = timer.elapsed_ms ();
+    AUDINFO ("Built search tree of %d items from %d entries in %.0f ms (%d threads)\n",
+     items.len (), entries, build_ms, threads);
+}
+
+/* Called by load() once the items and their children are in place. */
+void Database::finish_loaded ()
+{
+    init_visible (* arenas[0], sorted_roots);
+    index_items (* this, sorted_roots);
 }
 
-static int item_compare (const Item * const & a, const Item * const & b)
+SearchModel::~SearchModel ()
 {
-    if (a->field < b->field)
-        return -1;
-    if (a->field > b->field)
-        return 1;
+    cancel_search ();
+    if (m_build_thread.joinable ())
+        m_build_thread.join ();
+}
 
-    int val = str_compare (a->name, b->name);
-    if (val)
-        return val;
+void SearchModel::destroy_database ()
+{
+    /* drop any search or build in progress as well */
+    cancel_search ();
+    m_build_queued = false;
+    m_build_discard = m_building;
 
-    if (a->parent)
-        return b->parent ? item_compare (a->parent, b->parent) : 1;
-    else
-        return b->parent ? -1 : 0;
+    m_playlist = Playlist ();
+    m_database.clear ();
+    m_root_items.clear ();
+    m_roots_shown = 0;
+    m_labels.clear ();
+    m_last_terms.clear ();
+    m_results = m_hidden_items = 0;
 }
 
-void SearchModel::do_search (const Index<String> & terms)
+void SearchModel::create_database (Playlist playlist, const String & base_path)
 {
-    m_hidden_items = 0;
-    
-    // Mark all items as matching or not based on search
-    std::function<bool(Item *)> mark_matches = [&](Item * item) -> bool {
-        bool item_matches = false;
-        bool child_matches = false;
-        
-        // Check if this item matches search terms
-        for (int t = 0; t < terms.len(); t++)
+    m_build_playlist = playlist;
+    m_build_base_path = base_path;
+    m_build_queued = true;
+
+    /* otherwise finish_build() starts the next one */
+    if (! m_building)
+        start_build ();
+}
+
+void SearchModel::start_build ()
+{
+    /* snapshot the filenames; the playlist may change while we build */
+    Index<String> filenames;
+    int entries = m_build_playlist.n_entries ();
+    for (int e = 0; e < entries; e ++)
+        filenames.append (m_build_playlist.entry_filename (e));
+
+    m_build_queued = false;
+    m_building = true;
+
+    /* the tree shown may be from a snapshot of the same filenames */
+    m_build_against = m_database.get ();
+    uint64_t current = (m_database && m_database->base_path == m_build_base_path) ?
+     m_database->stamp : 0;
+
+    m_build_thread = std::thread ([this, filenames = std::move (filenames),
+     base_path = m_build_base_path, current, snapshot_path = m_snapshot_path] () {
+        uint64_t stamp = Database::make_stamp (filenames, base_path);
+        if (stamp != current)
         {
-            if (strstr(item->folded, terms[t]))
-            {
-                item_matches = true;
-                break;
-            }
+            m_built.capture (new Database);
+            m_built->build (filenames, base_path);
+            m_built->stamp = stamp;
+
+            if (snapshot_path)
+                m_built->save (snapshot_path);
         }
-        
-        // Check if any children match
-        const_cast<SimpleHash<Key, Item>&>(item->children).iterate([&](const Key &, Item & child) {
-            if (mark_matches(&child))
-                child_matches = true;
-        });
-        
-        // Item should be visible if it matches OR has matching children
-        item->m_search_visible = (item_matches || child_matches || terms.len() == 0);
-        return item->m_search_visible;
-    };
-    
-    // Mark all items
-    m_database.iterate([&](const Key &, Item & item) {
-        mark_matches(&item);
+
+        m_build_done.queue ([this] () { finish_build (); });
     });
-    
-    // Rebuild root items with only visible ones
-    build_root_items();
-}
\ No newline at end of file
+}
+
+void SearchModel::finish_build ()
+{
+    m_build_thread.join ();
+    m_building = false;
+
+    SmartPtr<Database> database = std::move (m_built);
+    Playlist playlist = m_build_playlist;
+
+    /* a newer snapshot was requested (or the library went away) meanwhile */
+    bool discard = m_build_queued || m_build_discard;
+    m_build_discard = false;
+
+    if (m_build_queued)
+        start_build ();
+
+    if (discard)
+        return;
+
+    if (database)
+        set_database (playlist, std::move (database));
+    else if (m_database.get () == m_build_against)
+    {
+        /* nothing changed; the entries of the tree shown are valid now */
+        m_playlist = playlist;
+        m_tree_kept = true;
+    }
+    else
+    {
+        /* another tree was put in place meanwhile; compare with that one */
+        create_database (playlist, m_build_base_path);
+        return;
+    }
+
+    if (ready_func)
+        ready_func (ready_data);
+}
+
+/* Marks <item> and everything below it as dropped from the tree. */
+static void remove_subtree (Item * item)
+{
+    item->removed = true;
+    for (Item * child : item->sorted)
+        remove_subtree (child);
+}
+
+/* What update_folders () found out about one folder before changing
+ * anything. */
+struct FolderPatch
+{
+    String folder;
+    Item * item = nullptr;
+    int first = 0;             /* where its entries start now */
+    int old_last = 0;          /* where they ended before */
+    int delta = 0;             /* how many more there are */
+    Index<String> filenames;   /* its entries now */
+};
+
+/* Finds the item of <folder> and its entries in <playlist>, given that the
+ * folders before it (in playlist order) have grown by <shift> entries. */
+static bool plan_patch (Database & db, Playlist playlist, PathSplitter & splitter,
+ const String & folder, int shift, FolderPatch & patch)
+{
+    /* the library itself, or something outside it */
+    bool below = splitter.split (folder);
+    int depth = splitter.parts ().len ();
+    if (! below || ! depth)
+        return false;
+
+    Item * item = nullptr;
+    for (auto & part : splitter.parts ())
+    {
+        Item * found = nullptr;
+        for (Item * child : item ? item->sorted : db.sorted_roots)
+        {
+            if (child->field != SearchField::Title &&
+             ! strncmp (child->name, part.str, part.len) && ! child->name[part.len])
+            {
+                found = child;
+                break;
+            }
+        }
+
+        /* a new folder; let a full build sort it in */
+        if (! (item = found))
+            return false;
+    }
+
+    if (! item->n_entries || ! item->entries_contiguous ())
+        return false;
+
+    /* The entries before the folder's are as they were, apart from those
+     * of the folders patched before it, so its entries start <shift> from
+     * where they did; see where they end now. */
+    StringBuf prefix = str_concat ({folder, "/"});
+    auto inside = [& prefix] (const char * filename)
+        { return filename && ! strncmp (filename, prefix, prefix.len ()); };
+
+    int first = item->first_entry + shift;
+    int entries = playlist.n_entries ();
+
+    if (first < 0 || first > entries || (first > 0 && inside (playlist.entry_filename (first - 1))))
+        return false;
+
+    patch.folder = folder;
+    patch.item = item;
+    patch.first = first;
+    patch.old_last = item->last_entry;
+
+    for (int e = first; e < entries; e ++)
+    {
+        String filename = playlist.entry_filename (e);
+        if (! inside (filename))
+            break;
+
+        patch.filenames.append (std::move (filename));
+    }
+
+    return true;
+}
+
+/* Whether the view knows about the row of <item>: it and all of its
+ * parents are among the rows handed over so far. */
+bool SearchModel::row_known (const Item * item) const
+{
+    for (; item; item = item->parent)
+    {
+        int shown = item->parent ? item->parent->shown : m_roots_shown;
+        if (item->row < 0 || item->row >= shown)
+            return false;
+    }
+
+    return true;
+}
+
+/* Takes the visible children of <item> out of the view. */
+void SearchModel::hide_children (Item * item)
+{
+    bool known = row_known (item) && item->shown;
+
+    if (known)
+        beginRemoveRows (createIndex (item->row, 0, item), 0, item->shown - 1);
+
+    for (Item * child : item->visible)
+        child->row = -1;
+
+    item->visible.clear ();
+    item->shown = 0;
+
+    if (known)
+        endRemoveRows ();
+}
+
+template<class List>
+static void remove_row (List & visible, int row)
+{
+    visible.remove (row, 1);
+    for (int r = row; r < visible.len (); r ++)
+        visible[r]->row = r;
+}
+
+/* Takes <item> (a visible one) out of the view, and out of its parent's
+ * visible list. */
+void SearchModel::hide_row (Item * item)
+{
+    Item * parent = item->parent;
+    int row = item->row;
+    int & shown = parent ? parent->shown : m_roots_shown;
+    bool known = row_known (item);
+
+    if (known)
+        beginRemoveRows (parent ? createIndex (parent->row, 0, parent) : QModelIndex (), row, row);
+
+    if (parent)
+        remove_row (parent->visible, row);
+    else
+        remove_row (m_root_items, row);
+
+    item->row = -1;
+
+    if (known)
+    {
+        shown --;
+        endRemoveRows ();
+    }
+}
+
+bool SearchModel::update_folders (Playlist playlist, const Index<String> & folders,
+ const String & base_path)
+{
+    /* a full build is on its way anyway */
+    if (! m_database || m_building || ! m_playlist.exists () ||
+     m_database->base_path != base_path)
+        return false;
+
+    /* nothing changed */
+    if (! folders.len ())
+        return true;
+
+    /* Everything is looked up first, so that nothing has changed if a full
+     * build is needed after all.  The folders are in playlist order, none
+     * inside another. */
+    PathSplitter splitter (base_path);
+    Index<FolderPatch> patches;
+    int shift = 0;
+
+    for (auto & folder : folders)
+    {
+        FolderPatch & patch = patches.append ();
+        if (! plan_patch (* m_database, playlist, splitter, folder, shift, patch))
+            return false;
+
+        patch.delta = patch.filenames.len () - patch.item->n_entries;
+        shift += patch.delta;
+    }
+
+    /* the search in progress is started over on the new tree */
+    bool resume = cancel_search ();
+
+    StopWatch timer;
+    int old_items = m_database->items.len ();
+    Index<Item *> relabel;
+
+    for (auto & patch : patches)
+    {
+        Item * item = patch.item;
+        for (Item * parent = item->parent; parent; parent = parent->parent)
+            parent->n_entries += patch.delta;
+
+        hide_children (item);
+        for (Item * child : item->sorted)
+            remove_subtree (child);
+
+        if (! patch.filenames.len ())
+        {
+            /* the folder is gone, and so are the folders that only held it */
+            Item * gone = item;
+            while (gone->parent && ! gone->parent->n_entries)
+                gone = gone->parent;
+
+            if (gone->row >= 0)
+                hide_row (gone);
+
+            remove_subtree (gone);
+
+            auto & siblings = gone->parent ? gone->parent->sorted : m_database->sorted_roots;
+            for (int i = 0; i < siblings.len (); i ++)
+            {
+                if (siblings[i] == gone)
+                {
+                    siblings.remove (i, 1);
+                    break;
+                }
+            }
+
+            relabel.append (gone->parent);
+        }
+        else
+        {
+            /* build the folder's new contents in an arena of their own */
+            m_database->arenas.append (new Arena);
+            Arena & arena = * m_database->arenas[m_database->arenas.len () - 1];
+            TreeBuilder tree (arena);
+
+            splitter.split (patch.folder);
+            int depth = splitter.parts ().len ();
+
+            for (int i = 0; i < patch.filenames.len (); i ++)
+            {
+                splitter.split (patch.filenames[i]);
+                tree.add_path (splitter.parts (), patch.first + i, depth);
+            }
+
+            std::sort (tree.roots.begin (), tree.roots.end (),
+             [] (const Item * a, const Item * b) { return item_order (a, b) < 0; });
+            sort_children (arena, tree.roots);
+
+            /* not in the view yet; the search below tells it about them */
+            for (Item * child : tree.roots)
+            {
+                child->parent = item;
+                child->row = -1;
+            }
+
+            item->sorted = tree.roots;
+            item->visible.reserve (arena, item->sorted.len ());
+            item->n_entries = patch.filenames.len ();
+
+            /* the new items are numbered after all the others */
+            index_items (* m_database, item->sorted);
+
+            relabel.append (item);
+        }
+
+        AUDINFO ("Updated %s: %d entries (%+d)\n", (const char *) patch.folder,
+         patch.filenames.len (), patch.delta);
+    }
+
+    /* Renumber the entries of the items that were there before, all at
+     * once: an entry moves by the growth of the folders that ended at or
+     * before it. */
+    Index<int> ends, shifts;
+    shifts.append (0);
+
+    for (auto & patch : patches)
+    {
+        ends.append (patch.old_last);
+        shifts.append (shifts[shifts.len () - 1] + patch.delta);
+    }
+
+    auto renumber = [&] (int & entry) {
+        entry += shifts[std::upper_bound (ends.begin (), ends.end (), entry) - ends.begin ()];
+    };
+
+    for (int id = 0; id < old_items; id ++)
+    {
+        Item * other = m_database->items[id];
+        if (other->removed)
+            continue;
+
+        for (int & entry : other->matches)
+            renumber (entry);
+
+        renumber (other->first_entry);
+        renumber (other->last_entry);
+    }
+
+    /* and the folders themselves, whose entries are all new */
+    for (auto & patch : patches)
+    {
+        if (patch.filenames.len ())
+        {
+            patch.item->first_entry = patch.first;
+            patch.item->last_entry = patch.first + patch.filenames.len ();
+        }
+    }
+
+    m_playlist = playlist;
+    restamp (playlist);
+
+    /* The last search is run again, telling the view about the rows that
+     * come and go, so that what is expanded and the scroll position stay
+     * as they were. */
+    Index<String> terms = std::move (m_last_terms);
+    search (terms, true);
+
+    /* the song counts along the way have changed */
+    for (Item * item : relabel)
+    {
+        for (; item; item = item->parent)
+        {
+            m_labels.remove (item);
+            if (row_known (item))
+            {
+                QModelIndex index = createIndex (item->row, 0, item);
+                emit dataChanged (index, index);
+            }
+        }
+    }
+
+    AUDINFO ("Updated %d folders in %.0f ms\n", patches.len (), timer.elapsed_ms ());
+
+    if (resume)
+        resume_search ();
+
+    return true;
+}
+
+/* Marks the tree as built from the filenames of <playlist>, so that an
+ * update that only touches metadata doesn't rebuild it. */
+void SearchModel::restamp (Playlist playlist)
+{
+    Index<String> filenames;
+    int entries = playlist.n_entries ();
+    for (int e = 0; e < entries; e ++)
+        filenames.append (playlist.entry_filename (e));
+
+    m_database->stamp = Database::make_stamp (filenames, m_database->base_path);
+}
+
+bool SearchModel::show_snapshot (const String & base_path)
+{
+    if (! m_snapshot_path || showing_snapshot (base_path))
+        return false;
+
+    SmartPtr<Database> database (new Database);
+    if (! database->load (m_snapshot_path, base_path))
+        return false;
+
+    set_database (Playlist (), std::move (database));
+    return true;
+}
+
+void SearchModel::set_match_all (bool match_all)
+{
+    /* the previous results can't be narrowed with the other semantics */
+    if (match_all != m_match_all)
+        m_last_terms.clear ();
+
+    m_match_all = match_all;
+}
+
+/* Swaps in a new database with a single model reset, showing the same
+ * search results as were shown for the old one. */
+void SearchModel::set_database (Playlist playlist, SmartPtr<Database> && database)
+{
+    bool resume = cancel_search ();
+    m_tree_kept = false;
+
+    Index<String> terms = std::move (m_last_terms);
+    StopWatch timer;
+
+    beginResetModel ();
+
+    m_playlist = playlist;
+    m_database = std::move (database);
+    m_root_items.clear ();
+    m_roots_shown = 0;
+    m_labels.clear ();
+    m_last_terms.clear ();
+
+    search (terms, false);
+
+    endResetModel ();
+
+    m_stats.items = m_database ? m_database->items.len () : 0;
+    m_stats.build_ms = m_database ? m_database->build_ms : 0;
+    m_stats.reset_ms = timer.elapsed_ms ();
+    AUDDBG ("Model reset took %.1f ms\n", m_stats.reset_ms);
+
+    if (resume)
+        resume_search ();
+}
+
+/* Works out a search without touching the items, so that it can run on
+ * another thread while the view reads them.  The database must not change
+ * until it is done.  It gives up as soon as <serial> moves on from <mine>. */
+class Searcher
+{
+public:
+    Searcher (Database & db, const std::atomic<int> & serial, int mine) :
+        m_db (db), m_serial (serial), m_mine (mine) {}
+
+    /* looks only at the items in <narrow>, if given, and shows no more
+     * than <max_results> matches (0 for all); returns false if cancelled */
+    bool run (const Index<String> & terms, bool match_all,
+     const ItemSet * narrow, int max_results, SearchResult & result);
+
+private:
+    bool cancelled () const
+        { return m_serial.load (std::memory_order_relaxed) != m_mine; }
+
+    /* called for each unit of work; checks for a newer search now and
+     * then, so that cancel_search () never waits long for the join */
+    bool should_stop ()
+        { return ! (++ m_work & 4095) && cancelled (); }
+
+    /* these return false if cancelled */
+    bool show_subtree (const Item * item);
+    bool search_recurse (const ArenaArray<Item *> & domain, unsigned mask);
+    bool keep_best (const Index<String> & terms, int count);
+
+    Database & m_db;
+    const std::atomic<int> & m_serial;
+    const int m_mine;
+
+    Index<unsigned> m_masks;    /* terms found in each name */
+    ItemSet m_below;            /* some descendant has a mask */
+    Index<int> m_results;       /* the items to show as matches */
+    SearchResult * m_result = nullptr;
+    unsigned m_work = 0;
+};
+
+/* Marks an item and everything below it visible. */
+bool Searcher::show_subtree (const Item * item)
+{
+    if (should_stop ())
+        return false;
+
+    m_result->visible.set (item->id);
+    for (const Item * child : item->sorted)
+    {
+        if (! show_subtree (child))
+            return false;
+    }
+
+    return true;
+}
+
+/* Used when all terms must match: <mask> holds the terms not found further
+ * up the path.  An item whose own name contains the rest is a result (and
+ * everything below it will be visible); otherwise its descendants may be.
+ * Subtrees without any matching names are skipped. */
+bool Searcher::search_recurse (const ArenaArray<Item *> & domain, unsigned mask)
+{
+    for (const Item * item : domain)
+    {
+        if (should_stop ())
+            return false;
+
+        unsigned new_mask = mask & ~ m_masks[item->id];
+
+        if (! new_mask)
+            m_results.append (item->id);
+        else if (m_below.get (item->id) && ! search_recurse (item->sorted, new_mask))
+            return false;
+    }
+
+    return true;
+}
+
+/* How well a result matches, best first: a name that is one of the terms,
+ * one that starts with one, and then the shallower, and the earlier in the
+ * tree. */
+struct Rank
+{
+    int fit, depth, id;
+
+    bool operator< (const Rank & b) const
+    {
+        if (fit != b.fit)
+            return fit > b.fit;
+        if (depth != b.depth)
+            return depth < b.depth;
+        return id < b.id;
+    }
+};
+
+/* Cuts m_results down to the best <count>, through a heap that holds the
+ * best ones so far with the worst of them on top. */
+bool Searcher::keep_best (const Index<String> & terms, int count)
+{
+    auto & items = m_db.items;
+    Index<Rank> best;
+
+    for (int id : m_results)
+    {
+        if (should_stop ())
+            return false;
+
+        const Item * item = items[id];
+        const char * name = item->folded ? item->folded : item->name;
+
+        Rank rank {0, 0, id};
+        for (auto & term : terms)
+            rank.fit = aud::max (rank.fit, start_folded (name, term));
+        for (const Item * p = item->parent; p; p = p->parent)
+            rank.depth ++;
+
+        if (best.len () < count)
+        {
+            best.append (rank);
+            std::push_heap (best.begin (), best.end ());
+        }
+        else if (rank < best[0])
+        {
+            std::pop_heap (best.begin (), best.end ());
+            best[count - 1] = rank;
+            std::push_heap (best.begin (), best.end ());
+        }
+    }
+
+    m_results.clear ();
+    for (auto & rank : best)
+        m_results.append (rank.id);
+
+    return true;
+}
+
+bool Searcher::run (const Index<String> & terms, bool match_all,
+ const ItemSet * narrow, int max_results, SearchResult & result)
+{
+    auto & items = m_db.items;
+    StopWatch timer;
+
+    result.terms.clear ();
+    for (auto & term : terms)
+        result.terms.append (term);
+
+    result.visible.reset (items.len (), ! terms.len ());
+    result.matches.reset (items.len (), false);
+    result.checked = result.matched = 0;
+    result.total = result.shown = 0;
+    m_result = & result;
+
+    // Only the first TermMatcher::max_terms terms are used
+    TermMatcher matcher;
+    for (auto & term : terms)
+        matcher.add (term);
+
+    // Collect the items whose own name contains one of the terms
+    Index<int> matched;
+    Index<int> candidates;
+    unsigned scan_mask = 0;
+
+    m_masks.clear ();
+    m_masks.insert (0, items.len ());
+
+    auto check = [&] (const Item * item, unsigned mask) {
+        if (item->removed || (narrow && ! narrow->get (item->id)))
+            return;
+
+        result.checked ++;
+        unsigned found = item->match (matcher, mask);
+        if (! found)
+            return;
+
+        if (! m_masks[item->id])
+            matched.append (item->id);
+        m_masks[item->id] |= found;
+    };
+
+    for (int t = 0; t < matcher.count (); t ++)
+    {
+        if (cancelled ())
+            return false;
+
+        if (m_db.trigrams.lookup (terms[t], candidates))
+        {
+            for (int id : candidates)
+            {
+                if (should_stop ())
+                    return false;
+
+                check (items[id], 1u << t);
+            }
+        }
+        else
+            scan_mask |= 1u << t;
+    }
+
+    // Terms too short for the index are checked against every item, all
+    // of them in the same pass
+    if (scan_mask)
+    {
+        for (int id = 0; id < items.len (); id ++)
+        {
+            if (should_stop ())
+                return false;
+
+            check (items[id], scan_mask);
+        }
+    }
+
+    m_results.clear ();
+
+    if (match_all && terms.len ())
+    {
+        // Item should be visible if all terms match along its path OR it
+        // has matching children
+        m_below.reset (items.len (), false);
+        for (int id : matched)
+        {
+            if (should_stop ())
+                return false;
+
+            for (const Item * p = items[id]->parent; p && ! m_below.get (p->id); p = p->parent)
+                m_below.set (p->id);
+        }
+
+        if (! search_recurse (m_db.sorted_roots, matcher.all ()))
+            return false;
+    }
+    else
+    {
+        for (int id : matched)
+            m_results.append (id);
+    }
+
+    result.total = m_results.len ();
+    if (max_results > 0 && m_results.len () > max_results &&
+     ! keep_best (terms, max_results))
+        return false;
+
+    // Item should be visible if it is a result OR has one below it; with
+    // all terms, so is everything below a result
+    for (int id : m_results)
+    {
+        if (should_stop ())
+            return false;
+
+        result.matches.set (id);
+
+        if (match_all && ! show_subtree (items[id]))
+            return false;
+
+        for (const Item * p = items[id]; p && ! result.visible.get (p->id); p = p->parent)
+            result.visible.set (p->id);
+    }
+
+    result.shown = m_results.len ();
+    result.matched = matched.len ();
+    result.search_ms = timer.elapsed_ms ();
+    return ! cancelled ();
+}
+
+/* Returns true if each of <terms> contains one of <others>. */
+static bool terms_contain (const Index<String> & terms, const Index<String> & others)
+{
+    for (auto & term : terms)
+    {
+        bool found = false;
+        for (auto & other : others)
+        {
+            if (strstr (term, other))
+            {
+                found = true;
+                break;
+            }
+        }
+
+        if (! found)
+            return false;
+    }
+
+    return true;
+}
+
+/* Returns true if anything matching <terms> also matched <prev>, so that
+ * there is no need to look beyond the items that are visible now.  If any
+ * term may match, that is the case when each new term contains one of the
+ * previous terms; if all terms must match, when each previous term is
+ * contained in one of the new terms. */
+static bool is_refinement (const Index<String> & terms, const Index<String> & prev,
+ bool match_all)
+{
+    if (! terms.len () || ! prev.len ())
+        return false;
+
+    return match_all ? terms_contain (prev, terms) : terms_contain (terms, prev);
+}
+
+/* Shows the new visible list of <item>, and those of its visible
+ * descendants, without telling the view. */
+static void rebuild_subtree (Item * item)
+{
+    item->shown = build_visible (item->sorted, item->visible);
+    for (Item * child : item->visible)
+        rebuild_subtree (child);
+}
+
+/* Brings <visible>, the visible list of <parent> (null at the top level),
+ * in line with the new visibility of the items in <sorted>, telling the
+ * view about each run of removed or inserted rows.  Items that were and
+ * still are visible are updated recursively; items newly shown get their
+ * whole subtree rebuilt before their insertion is announced.  An item was
+ * visible if it has a row, which holds for all children of an item that
+ * was visible itself.
+ *
+ * The view only knows the first <shown> rows; changes past those are made
+ * quietly and come into view through fetchMore().  Rows appended to a list
+ * that is shown in full are announced up to the page size. */
+template<class List>
+void SearchModel::update_rows (Item * parent, const ArenaArray<Item *> & sorted,
+ List & visible, int & shown)
+{
+    QModelIndex parent_index = parent ? createIndex (parent->row, 0, parent) : QModelIndex ();
+    int row = 0;
+
+    auto renumber = [&] (int from) {
+        for (int r = from; r < visible.len (); r ++)
+            visible[r]->row = r;
+    };
+
+    for (int i = 0; i < sorted.len ();)
+    {
+        Item * item = sorted[i];
+        bool was = (item->row >= 0);
+        bool now = item->m_search_visible;
+
+        if (was == now)
+        {
+            if (now)
+            {
+                item->row = row ++;
+                if (item->row < shown)
+                    update_rows (item, item->sorted, item->visible, item->shown);
+                else
+                    rebuild_subtree (item);
+            }
+
+            i ++;
+            continue;
+        }
+
+        /* collect the run, which may be interleaved with items that are
+         * not visible either way */
+        Index<Item *> run;
+        for (; i < sorted.len (); i ++)
+        {
+            Item * other = sorted[i];
+            bool other_was = (other->row >= 0);
+            bool other_now = other->m_search_visible;
+
+            if (other_was == was && other_now == now)
+                run.append (other);
+            else if (other_was || other_now)
+                break;
+        }
+
+        if (was)
+        {
+            int count = (row < shown) ? aud::min (run.len (), shown - row) : 0;
+
+            if (count)
+                beginRemoveRows (parent_index, row, row + count - 1);
+
+            visible.remove (row, run.len ());
+            for (Item * removed : run)
+                removed->row = -1;
+            renumber (row);
+            shown -= count;
+
+            if (count)
+                endRemoveRows ();
+        }
+        else
+        {
+            int count = 0;
+            if (row < shown)
+                count = run.len ();
+            else if (row == shown && shown == visible.len ())
+                count = aud::clamp (fetch_page - shown, 0, run.len ());
+
+            if (count)
+                beginInsertRows (parent_index, row, row + count - 1);
+
+            visible.insert (row, run.len ());
+            for (int r = 0; r < run.len (); r ++)
+            {
+                visible[row + r] = run[r];
+                rebuild_subtree (run[r]);
+            }
+            renumber (row);
+            shown += count;
+
+            if (count)
+                endInsertRows ();
+
+            row += run.len ();
+        }
+    }
+}
+
+void SearchModel::do_search (const Index<String> & terms)
+{
+    search (terms, true);
+}
+
+/* The items the last search showed, if <terms> can only hide some of them. */
+const ItemSet * SearchModel::narrowed_from (const Index<String> & terms) const
+{
+    // Hidden items cannot become visible again as the query is narrowed,
+    // unless they were only cut off by the result cap
+    if (! is_refinement (terms, m_last_terms, m_match_all) || m_hidden_items ||
+     m_visible_set.size () != m_database->items.len ())
+        return nullptr;
+
+    return & m_visible_set;
+}
+
+/* Works out which items match <terms>.  With <notify>, the view is told
+ * about the rows that come and go; otherwise the caller resets the model. */
+void SearchModel::search (const Index<String> & terms, bool notify)
+{
+    cancel_search ();
+
+    if (! m_database)
+    {
+        m_results = m_hidden_items = 0;
+        m_root_items.clear();
+        m_roots_shown = 0;
+        m_last_terms.clear();
+        for (auto & term : terms)
+            m_last_terms.append(term);
+        return;
+    }
+
+    SearchResult found;
+    Searcher (* m_database, m_search_serial, m_search_serial).run (terms,
+     m_match_all, narrowed_from (terms), m_max_results, found);
+
+    show_found (found, notify);
+}
+
+void SearchModel::start_search (const Index<String> & terms)
+{
+    cancel_search ();
+
+    if (! m_database)
+    {
+        search (terms, true);
+        if (searched_func)
+            searched_func (searched_data);
+        return;
+    }
+
+    /* the thread gets copies of everything but the database */
+    Index<String> copy;
+    m_search_terms.clear ();
+    for (auto & term : terms)
+    {
+        copy.append (term);
+        m_search_terms.append (term);
+    }
+
+    const ItemSet * narrow = narrowed_from (terms);
+    int serial = m_search_serial;
+
+    m_search_thread = std::thread ([this, db = m_database.get (),
+     terms = std::move (copy), match_all = m_match_all, max_results = m_max_results,
+     narrowing = (bool) narrow, visible = narrow ? * narrow : ItemSet (), serial] () {
+        SearchResult found;
+        if (Searcher (* db, m_search_serial, serial).run (terms, match_all,
+         narrowing ? & visible : nullptr, max_results, found))
+        {
+            m_found = std::move (found);
+            m_found_serial = serial;
+            m_search_done.queue ([this] () { finish_search (); });
+        }
+    });
+}
+
+void SearchModel::finish_search ()
+{
+    /* a newer search has taken over */
+    if (m_found_serial != m_search_serial || ! m_search_thread.joinable ())
+        return;
+
+    m_search_thread.join ();
+    show_found (m_found, true);
+
+    if (searched_func)
+        searched_func (searched_data);
+}
+
+/* Drops the search in progress, if any, and returns whether there was one.
+ * Must be called before the database is changed or replaced. */
+bool SearchModel::cancel_search ()
+{
+    m_search_serial ++;
+    if (! m_search_thread.joinable ())
+        return false;
+
+    m_search_thread.join ();
+    return true;
+}
+
+/* Starts the search dropped by cancel_search () over on the new tree. */
+void SearchModel::resume_search ()
+{
+    Index<String> terms = std::move (m_search_terms);
+    start_search (terms);
+}
+
+/* Puts the result of a search in place. */
+void SearchModel::show_found (SearchResult & found, bool notify)
+{
+    auto & items = m_database->items;
+    StopWatch timer;
+
+    for (Item * item : items)
+    {
+        item->m_search_visible = found.visible.get (item->id);
+        item->m_search_match = found.matches.get (item->id);
+    }
+
+    if (notify)
+        update_rows(nullptr, m_database->sorted_roots, m_root_items, m_roots_shown);
+    else
+    {
+        // Rebuild the visible views (those of hidden items are never queried)
+        for (Item * item : items)
+        {
+            if (item->m_search_visible)
+                item->shown = build_visible(item->sorted, item->visible);
+        }
+
+        m_roots_shown = build_visible(m_database->sorted_roots, m_root_items);
+    }
+
+    m_results = found.terms.len () ? found.shown : m_root_items.len ();
+    m_hidden_items = found.total - found.shown;
+
+    m_stats.checked = found.checked;
+    m_stats.matched = found.matched;
+    m_stats.search_ms = found.search_ms;
+    m_stats.rows_ms = timer.elapsed_ms();
+    AUDDBG("Search for %d terms checked %d names, %d matching, in %.1f ms "
+     "(%.1f ms for the rows); showing %d of %d results\n", found.terms.len(),
+     found.checked, found.matched, m_stats.search_ms, m_stats.rows_ms,
+     found.shown, found.total);
+
+    m_last_terms = std::move (found.terms);
+    m_visible_set = std::move (found.visible);
+}
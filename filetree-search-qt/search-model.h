@@ -20,13 +20,27 @@
 #ifndef SEARCHMODEL_H
 #define SEARCHMODEL_H
 
+#include <atomic>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
 #include <QAbstractItemModel>
+#include <QCache>
+#include <QFile>
 
 #include <libaudcore/audstrings.h>
 #include <libaudcore/i18n.h>
+#include <libaudcore/mainloop.h>
 #include <libaudcore/multihash.h>
+#include <libaudcore/objects.h>
 #include <libaudcore/playlist.h>
 
+#include "arena.h"
+#include "name-match.h"
+#include "timing.h"
+#include "trigram-index.h"
+
 enum class SearchField {
     Genre,
     Artist,
@@ -47,47 +61,200 @@ static inline const char * parent_prefix (SearchField parent)
      SearchField::HiddenAlbum) ? _("on") : _("by");
 }
 
-struct Key
-{
-    SearchField field;
-    String name;
-
-    bool operator== (const Key & b) const
-        { return field == b.field && name == b.name; }
-    unsigned hash () const
-        { return (unsigned) field + name.hash (); }
-};
-
+/* Items live in the arenas of their Database and are never destructed;
+ * the names point into the same arenas.  Most names are plain ASCII, so
+ * only other names get a lower-cased copy in <folded>; for the rest it is
+ * null and matching folds the name on the fly. */
 struct Item
 {
     SearchField field;
-    String name, folded;
+    const char * name, * folded;
+    const char * key;       /* the name in sort_key () form; may be <name> */
     Item * parent;
-    SimpleHash<Key, Item> children;
-    Index<int> matches;
+    ArenaArray<Item *> sorted;   /* all children, in display order */
+    ArenaArray<Item *> visible;  /* visible children, rebuilt by do_search() */
+    ArenaArray<int> matches;
+    int id = -1;            /* position in Database::items */
+
+    /* the playlist entries in the subtree: how many there are, and the
+     * range [first_entry, last_entry) they lie within */
+    int n_entries = 0;
+    int first_entry = -1, last_entry = -1;
+
+    bool removed = false;   /* dropped by update_folders (), but still in
+                               Database::items */
+    int row = -1;           /* position in the parent's visible list */
+    int shown = 0;          /* leading part of <visible> the view knows about */
     bool m_search_visible = true;
+    bool m_search_match = false;   /* a match of the last search itself */
 
-    Item (SearchField field, const String & name, Item * parent) :
+    Item (SearchField field, const char * name, const char * folded,
+     const char * key, Item * parent) :
         field (field),
         name (name),
-        folded (str_tolower_utf8 (name)),
+        folded (folded),
+        key (key),
         parent (parent) {}
 
-    Item (Item &&) = default;
-    Item & operator= (Item &&) = default;
+    /* whether the range holds nothing but the subtree's entries, which is
+     * the rule since the Library playlist is sorted by path */
+    bool entries_contiguous () const
+        { return last_entry - first_entry == n_entries; }
+
+    /* returns the subset of the terms in <mask> that the name contains */
+    unsigned match (const TermMatcher & terms, unsigned mask) const
+        { return terms.match (folded ? folded : name, mask); }
+};
+
+/* The folder tree built from a snapshot of the Library playlist.  It does
+ * not touch the model, so it can be built on any thread.  All of the items
+ * are released at once together with the arenas. */
+struct Database
+{
+    Index<SmartPtr<Arena>> arenas;    /* one per build thread */
+    ArenaArray<Item *> sorted_roots;  /* all top-level items, in display order */
+    Index<Item *> items;              /* all items, by Item::id */
+    TrigramIndex trigrams;
+    double build_ms = 0;
+
+    String base_path;
+    uint64_t stamp = 0;               /* of the filenames it was built from */
+    SmartPtr<QFile> snapshot;         /* mapped; holds the names if loaded */
+
+    void build (const Index<String> & filenames, const String & base_path);
+
+    /* identifies a list of filenames (never 0) */
+    static uint64_t make_stamp (const Index<String> & filenames, const char * base_path);
+
+    /* A snapshot is a file the tree can be read back from much faster than
+     * it is built, so that it can be shown before the playlist is loaded.
+     * Loading fails unless the snapshot was saved for <base_path>. */
+    bool save (const char * path) const;
+    bool load (const char * path, const String & base_path);
+
+private:
+    void finish_loaded ();
+};
+
+/* A set of items of a database, by Item::id, one bit each. */
+class ItemSet
+{
+public:
+    void reset (int size, bool value)
+    {
+        m_size = size;
+        m_words.assign ((size + 63) / 64, value ? ~ (uint64_t) 0 : 0);
+    }
+
+    int size () const { return m_size; }
+    bool get (int id) const { return (m_words[id >> 6] >> (id & 63)) & 1; }
+    void set (int id) { m_words[id >> 6] |= (uint64_t) 1 << (id & 63); }
+
+private:
+    std::vector<uint64_t> m_words;
+    int m_size = 0;
+};
+
+/* What a search found, worked out without touching the items. */
+struct SearchResult
+{
+    Index<String> terms;
+    ItemSet visible;         /* matches, their ancestors and (for match-all) descendants */
+    ItemSet matches;         /* matches of the search itself */
+    int checked = 0, matched = 0;
+    int total = 0;           /* results found */
+    int shown = 0;           /* results kept, the best <max_results> */
+    double search_ms = 0;
+};
+
+/* what the current database and the last search cost */
+struct SearchStats
+{
+    int items = 0;           /* in the database */
+    double build_ms = 0;
+    double reset_ms = 0;     /* swapping in the database */
+    int checked = 0;         /* names compared with the terms */
+    int matched = 0;         /* names containing a term */
+    double search_ms = 0;    /* finding the matches */
+    double rows_ms = 0;      /* telling the view */
 };
 
 class SearchModel : public QAbstractItemModel
 {
 public:
+    ~SearchModel ();
+
+    /* called when a database started by create_database() is in place */
+    void connect_ready (void (* func) (void *), void * data) {
+        ready_func = func;
+        ready_data = data;
+    }
+
+    /* called when the results of start_search () are shown */
+    void connect_searched (void (* func) (void *), void * data) {
+        searched_func = func;
+        searched_data = data;
+    }
+
+    bool is_building () const { return m_building; }
+    /* false while a snapshot is shown that isn't matched up with the
+     * playlist yet; its entry numbers can't be used then */
+    bool has_playlist () const { return m_playlist.exists (); }
+    /* whether the last build found the tree shown up to date, so that it
+     * was left in place with its rows and entry numbers */
+    bool tree_kept () const { return m_tree_kept; }
+
+    /* whether all search terms must match somewhere along an item's path,
+     * rather than any of them in its own name */
+    void set_match_all (bool match_all);
+    /* shows only the best <max_results> matches of each search (0 for all);
+     * the rest are counted as hidden */
+    void set_max_results (int max_results) { m_max_results = max_results; }
     int num_items () const { return m_root_items.len (); }
     const Item * item_at_index (const QModelIndex & index) const;
+    /* the matches shown, or the top-level items if there are no terms */
+    int num_results () const { return m_results; }
     int num_hidden_items () const { return m_hidden_items; }
+    const SearchStats & stats () const { return m_stats; }
+
+    /* the playlist entries of the items at <indexes> and everything below
+     * them, in playlist order and without duplicates */
+    void collect_entries (const QModelIndexList & indexes, Index<int> & entries) const;
+
+    /* the folders to expand, parents first, to bring the matches of the last
+     * search into view without revealing more than <budget> rows */
+    QModelIndexList expansion (int budget) const;
 
+    /* resets the view; do_search () tells it about the changes by itself */
     void update ();
     void destroy_database ();
+    /* builds the new database in the background; until it is ready, the
+     * current one stays in place */
     void create_database (Playlist playlist, const String & base_path = String());
+    /* where to save each database built; it is also where show_snapshot ()
+     * looks */
+    void set_snapshot_path (const char * path) { m_snapshot_path = String (path); }
+    /* shows the tree last saved for <base_path> until create_database () is
+     * done; its playlist entries can't be used meanwhile.  Returns false if
+     * there is none to show, or if it is on show already. */
+    bool show_snapshot (const String & base_path);
+    bool showing_snapshot (const String & base_path) const
+        { return m_database && ! m_playlist.exists () && m_database->base_path == base_path; }
+    /* brings the tree in line with the playlist after <folders> (URIs below
+     * <base_path>, in playlist order and none inside another) have been
+     * rescanned, replacing just their subtrees, or dropping those of folders
+     * that are gone; the view is told about the rows that change.  Returns
+     * false, with nothing changed, if that's not possible and a full build
+     * is needed. */
+    bool update_folders (Playlist playlist, const Index<String> & folders,
+     const String & base_path);
+    /* puts a database built elsewhere in place (as create_database () does
+     * once the build is finished) */
+    void set_database (Playlist playlist, SmartPtr<Database> && database);
     void do_search (const Index<String> & terms);
+    /* does the same on another thread, dropping the search in progress;
+     * the results replace the old ones only when complete */
+    void start_search (const Index<String> & terms);
 
     int rowCount (const QModelIndex & parent) const override;
     int columnCount (const QModelIndex & parent) const override { return 1; }
@@ -95,6 +262,8 @@ public:
     QModelIndex parent (const QModelIndex & index) const override;
     QModelIndex index (int row, int column, const QModelIndex & parent = QModelIndex ()) const override;
     bool hasChildren (const QModelIndex & parent = QModelIndex ()) const override;
+    bool canFetchMore (const QModelIndex & parent) const override;
+    void fetchMore (const QModelIndex & parent) override;
 
     Qt::ItemFlags flags (const QModelIndex & index) const override
     {
@@ -112,13 +281,65 @@ public:
     QMimeData * mimeData (const QModelIndexList & indexes) const override;
 
 private:
-    void add_to_database (int entry, std::initializer_list<Key> keys);
-    void build_root_items();
+    void search (const Index<String> & terms, bool notify);
+    const ItemSet * narrowed_from (const Index<String> & terms) const;
+    void finish_search ();
+    bool cancel_search ();
+    void resume_search ();
+    void show_found (SearchResult & found, bool notify);
+    template<class List>
+    void update_rows (Item * parent, const ArenaArray<Item *> & sorted,
+     List & visible, int & shown);
+
+    void start_build ();
+    void finish_build ();
+
+    bool row_known (const Item * item) const;
+    void hide_children (Item * item);
+    void hide_row (Item * item);
+    void restamp (Playlist playlist);
 
     Playlist m_playlist;
-    SimpleHash<Key, Item> m_database;
-    Index<Item *> m_root_items;
+    SmartPtr<Database> m_database;
+    Index<Item *> m_root_items;    /* visible top-level items */
+    int m_roots_shown = 0;         /* leading part of m_root_items in the view */
+    Index<String> m_last_terms;    /* terms of the search currently shown */
+    mutable QCache<const Item *, QString> m_labels {4096};  /* by data() */
+    bool m_match_all = false;
+    int m_max_results = 0;
+    int m_results = 0;
     int m_hidden_items = 0;
+    SearchStats m_stats;
+    ItemSet m_visible_set;         /* as of the search currently shown */
+
+    /* background search; m_found is only touched by the search thread
+     * until it has been joined.  Each search has a serial number, and
+     * gives up once it is no longer the latest. */
+    std::thread m_search_thread;
+    std::atomic<int> m_search_serial {0};
+    std::atomic<int> m_found_serial {-1};
+    SearchResult m_found;
+    QueuedFunc m_search_done;
+    Index<String> m_search_terms;  /* of the search in progress */
+
+    /* background build; m_built is only touched by the build thread until
+     * it has been joined */
+    std::thread m_build_thread;
+    SmartPtr<Database> m_built;
+    QueuedFunc m_build_done;
+    Playlist m_build_playlist;
+    String m_build_base_path;
+    const Database * m_build_against = nullptr;  /* the database shown at the start */
+    String m_snapshot_path;
+    bool m_building = false;
+    bool m_build_queued = false;
+    bool m_build_discard = false;
+    bool m_tree_kept = false;
+
+    void (* ready_func) (void *) = nullptr;
+    void * ready_data = nullptr;
+    void (* searched_func) (void *) = nullptr;
+    void * searched_data = nullptr;
 };
 
 #endif // SEARCHMODEL_H
\ No newline at end of file
@@ -17,11 +17,16 @@
  * the use of this software.
  */
 
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+
 #include <QApplication>
 #include <QBoxLayout>
 #include <QContextMenuEvent>
-#include <QDirIterator>
-#include <QFileSystemWatcher>
+#include <QDir>
+#include <QFileInfo>
 #include <QIcon>
 #include <QLabel>
 #include <QLineEdit>
@@ -41,12 +46,17 @@
 #include <libaudqt/libaudqt.h>
 #include <libaudqt/treeview.h>
 
+#include "dir-monitor.h"
 #include "html-delegate.h"
 #include "library.h"
 #include "search-model.h"
 
 #define CFG_ID "search-tool"
-#define SEARCH_DELAY 300
+#define SEARCH_DELAY 10
+#define CLICK_DELAY 100
+#define RESCAN_DELAY 500
+#define SCANNED_DELAY 100
+#define MAX_PATCHES 32
 
 class SearchToolQt : public GeneralPlugin
 {
@@ -113,10 +123,31 @@ protected:
     }
 };
 
+/* The rows of the Browser whose metadata a scan pass had to wait for,
+ * handed over to the main thread in batches.  The thread of a pass is
+ * never joined, since it may sit waiting for an entry to be scanned; it
+ * holds a reference of its own and quits once it sees <cancelled>.  That
+ * is set, and <done> stopped, under the lock, so that nothing is queued
+ * for the widget afterwards. */
+struct ScanPass
+{
+    std::atomic<bool> cancelled {false};
+    std::mutex mutex;
+    Index<int> rows;
+    Index<PlaylistAddItem> items;
+    QueuedFunc done;
+};
+
 class SearchWidget : public QWidget
 {
 public:
     SearchWidget ();
+    ~SearchWidget ()
+    {
+        cancel_load ();
+        if (m_load_thread.joinable ())
+            m_load_thread.join ();
+    }
 
     void grab_focus () { m_search_entry.setFocus (Qt::OtherFocusReason); }
 
@@ -126,11 +157,17 @@ public:
 private:
     void init_library ();
     void show_hide_widgets ();
-    void search_timeout ();
+    void search_timeout (bool wait = false);
+    void search_done ();
+    void show_results ();
+    void show_counts ();
     void library_updated ();
+    bool update_folders (const Index<String> & folders, const String & base_path);
+    void database_ready ();
     void location_changed ();
-    void walk_library_paths ();
     void setup_monitor ();
+    void rescan_folder (const QString & path);
+    void start_rescans ();
 
     void do_add (bool play, bool set_title);
     void action_play ();
@@ -138,6 +175,14 @@ private:
     void action_add_to_playlist ();
     void on_item_clicked (const QModelIndex & index);
     void on_item_load_timer ();
+    void start_load (Index<int> && entries, bool refill);
+    void finish_load (int serial);
+    void start_scan ();
+    void browser_added ();
+    void fill_scanned ();
+    bool finish_replace ();
+    void drop_scan ();
+    void cancel_load ();
     void show_context_menu (const QPoint & global_pos);
 
     Library m_library;
@@ -145,9 +190,34 @@ private:
     HtmlDelegate m_delegate;
     
     Playlist m_browser_playlist;  // Dedicated Browser playlist
-
-    SmartPtr<QFileSystemWatcher> m_watcher;
-    QStringList m_watcher_paths;
+    Index<int> m_browser_entries; // Library entries it was last filled with
+
+    /* background load into the Browser; the thread is the only one to touch
+     * m_load_items until it has been joined */
+    std::thread m_load_thread;
+    std::atomic<int> m_load_serial {0};
+    QueuedFunc m_load_done;
+    Index<int> m_load_entries;
+    Index<PlaylistAddItem> m_load_items;
+    int m_load_prefix = 0, m_load_suffix = 0;
+
+    /* the scan pass running, and on the main thread: the load whose pass
+     * is to start, the rows still to fill, and the run last inserted, in
+     * front of the rows it replaces (which go once it is in) */
+    std::shared_ptr<ScanPass> m_scan;
+    int m_scan_waiting = -1;
+    Index<int> m_fill_rows;
+    Index<PlaylistAddItem> m_fill_items;
+    int m_fill_next = 0;
+    int m_replace_first = -1, m_replace_total = 0, m_restore_focus = -1;
+    Index<bool> m_restore_selected;
+
+    HookReceiver<SearchWidget> m_add_hook
+     {"playlist add complete", this, & SearchWidget::browser_added};
+
+    SmartPtr<DirMonitor> m_monitor;
+    QStringList m_pending_rescans; // changed folders, oldest first
+    QueuedFunc m_rescan_timer;
 
     QueuedFunc m_search_timer;
     bool m_search_pending = false;
@@ -168,6 +238,10 @@ const char * const SearchToolQt::defaults[] = {
     "rescan_on_startup", "FALSE",
     "monitor", "FALSE",
     "close_to_tray", "FALSE",
+    "match_all", "FALSE",
+    "expand_rows", "1000",
+    "max_results", "5000",
+    "show_timings", "FALSE",
     nullptr
 };
 
@@ -177,7 +251,16 @@ const PreferencesWidget SearchToolQt::widgets[] = {
     WidgetCheck (N_("Monitor library for changes"),
         WidgetBool (CFG_ID, "monitor", [] () { s_widget->reset_monitor (); })),
     WidgetCheck (N_("Close to the system tray"),
-        WidgetBool (CFG_ID, "close_to_tray"))
+        WidgetBool (CFG_ID, "close_to_tray")),
+    WidgetCheck (N_("Search words must all match (in the folder path)"),
+        WidgetBool (CFG_ID, "match_all", [] () { if (s_widget) s_widget->trigger_search (); })),
+    WidgetSpin (N_("Expand search results up to:"),
+        WidgetInt (CFG_ID, "expand_rows"), {0, 100000, 100}, N_("rows")),
+    WidgetSpin (N_("Show search results up to:"),
+        WidgetInt (CFG_ID, "max_results", [] () { if (s_widget) s_widget->trigger_search (); }),
+        {0, 1000000, 100}, N_("(0 for all)")),
+    WidgetCheck (N_("Show timings below the results"),
+        WidgetBool (CFG_ID, "show_timings", [] () { if (s_widget) s_widget->trigger_search (); }))
 };
 
 const PluginPreferences SearchToolQt::prefs = {{widgets}};
@@ -221,6 +304,8 @@ SearchWidget::SearchWidget () :
     m_results_list.setHeaderHidden (true);
     m_results_list.setModel (& m_model);
     m_results_list.setItemDelegate (& m_delegate);
+    QObject::connect (& m_model, & QAbstractItemModel::modelReset, this,
+     [this] () { m_delegate.clear_cache (); });
     m_results_list.setSelectionMode (QTreeView::ExtendedSelection);
     m_results_list.setDragDropMode (QTreeView::DragOnly);
     m_results_list.setContextMenuPolicy (Qt::CustomContextMenu);
@@ -265,8 +350,15 @@ SearchWidget::SearchWidget () :
     QObject::connect (& m_search_entry, & QLineEdit::returnPressed, this, & SearchWidget::action_play);
     QObject::connect (& m_results_list, & QTreeView::activated, this, & SearchWidget::action_play);
     QObject::connect (& m_results_list, & QTreeView::clicked, this, & SearchWidget::on_item_clicked);
+    QObject::connect (m_results_list.selectionModel (), & QItemSelectionModel::currentChanged,
+     this, [this] (const QModelIndex & index) {
+        // browsing with the keyboard; searches move the current row, too
+        if (m_results_list.hasFocus ())
+            on_item_clicked (index);
+    });
     QObject::connect (& m_results_list, & QTreeView::doubleClicked, this, [this] (const QModelIndex &) {
         m_click_timer.stop();
+        cancel_load();
     });
 
     QObject::connect (& m_results_list, & QWidget::customContextMenuRequested,
@@ -301,6 +393,12 @@ void SearchWidget::init_library ()
 {
     m_library.connect_update
      (aud::obj_member<SearchWidget, & SearchWidget::library_updated>, this);
+    m_model.connect_ready
+     (aud::obj_member<SearchWidget, & SearchWidget::database_ready>, this);
+    m_model.connect_searched
+     (aud::obj_member<SearchWidget, & SearchWidget::search_done>, this);
+    m_model.set_snapshot_path (filename_build
+     ({aud_get_path (AudPath::UserDir), "filetree-search.snapshot"}));
 
     if (aud_get_bool (CFG_ID, "rescan_on_startup"))
         m_library.begin_add (get_uri ());
@@ -321,7 +419,9 @@ void SearchWidget::show_hide_widgets ()
     {
         m_help_label.hide ();
 
-        if (m_library.is_ready ())
+        /* keep waiting until the first database has been built (or the
+         * last one has been read back) */
+        if (m_model.num_items () || (m_library.is_ready () && ! m_model.is_building ()))
         {
             m_wait_label.hide ();
             m_results_list.show ();
@@ -336,39 +436,85 @@ void SearchWidget::show_hide_widgets ()
     }
 }
 
-void SearchWidget::search_timeout ()
+/* Searches on another thread, so that typing goes on meanwhile; with
+ * <wait>, the results are in place on return. */
+void SearchWidget::search_timeout (bool wait)
 {
     auto text = m_search_entry.text ().toUtf8 ();
     auto terms = str_list_to_index (str_tolower_utf8 (text), " ");
-    m_model.do_search (terms);
-    m_model.update ();
+    m_model.set_match_all (aud_get_bool (CFG_ID, "match_all"));
+    m_model.set_max_results (aud_get_int (CFG_ID, "max_results"));
 
-    int shown = m_model.num_items ();
-    int hidden = m_model.num_hidden_items ();
-    int total = shown + hidden;
+    m_search_timer.stop ();
+
+    if (wait)
+    {
+        m_model.do_search (terms);
+        search_done ();
+    }
+    else
+        m_model.start_search (terms);
+}
+
+void SearchWidget::search_done ()
+{
+    show_results ();
 
-    if (shown)
+    // the text may have changed again since
+    m_search_pending = m_search_timer.running ();
+}
+
+void SearchWidget::show_results ()
+{
+    if (m_model.num_items ())
     {
         auto sel = m_results_list.selectionModel ();
         sel->select (m_model.index (0, 0), sel->Clear | sel->SelectCurrent);
         
-        // Auto-expand all items if there's a search term
-        if (text.size() > 0)
+        // Open the folders leading to the matches if there's a search
+        // term, as far as the row budget allows; the rest can be expanded
+        // by hand
+        if (m_search_entry.text ().isEmpty ())
+            m_results_list.collapseAll ();
+        else
         {
-            m_results_list.expandAll();
+            StopWatch timer ("Expanding the results");
+            int budget = aud_get_int (CFG_ID, "expand_rows");
+            for (auto & index : m_model.expansion (budget))
+                m_results_list.expand (index);
         }
     }
 
-    if (hidden)
-        m_stats_label.setText ((const char *)
-         str_printf (dngettext (PACKAGE, "%d of %d result shown",
-         "%d of %d results shown", total), shown, total));
-    else
-        m_stats_label.setText ((const char *)
-         str_printf (dngettext (PACKAGE, "%d result", "%d results", total), total));
+    show_counts ();
+}
 
-    m_search_timer.stop ();
-    m_search_pending = false;
+void SearchWidget::show_counts ()
+{
+    int shown = m_model.num_results ();
+    int hidden = m_model.num_hidden_items ();
+    int total = shown + hidden;
+
+    StringBuf text = hidden ?
+     str_printf (dngettext (PACKAGE, "%d of %d result shown",
+     "%d of %d results shown", total), shown, total) :
+     str_printf (dngettext (PACKAGE, "%d result", "%d results", total), total);
+
+    auto paint = m_delegate.take_stats ();
+    AUDDBG ("Painted %d rows, %d labels cached, %d laid out\n",
+     paint.painted, paint.hits, paint.misses);
+
+    // Debug line; the painting is that of the previous results
+    if (aud_get_bool (CFG_ID, "show_timings"))
+    {
+        auto & stats = m_model.stats ();
+        str_append_printf (text, "\nsearch %.1f + %.1f ms, %d names checked; "
+         "build %.0f ms, %d items; reset %.1f ms; painted %d rows, %d%% cached",
+         stats.search_ms, stats.rows_ms, stats.checked, stats.build_ms,
+         stats.items, stats.reset_ms, paint.painted,
+         (paint.hits + paint.misses) ? 100 * paint.hits / (paint.hits + paint.misses) : 0);
+    }
+
+    m_stats_label.setText ((const char *) text);
 }
 
 void SearchWidget::trigger_search ()
@@ -381,15 +527,74 @@ void SearchWidget::library_updated ()
 {
     if (m_library.is_ready ())
     {
+        /* after a folder rescan, only the subtrees that changed have to be
+         * rebuilt; the current tree stays usable until database_ready ()
+         * otherwise */
         auto uri = audqt::file_entry_get_uri (m_file_entry);
-        m_model.create_database (m_library.playlist (), String(uri));
-        search_timeout ();
+        Index<String> folders;
+
+        if (! m_library.take_changes (folders) || folders.len () > MAX_PATCHES ||
+         ! update_folders (folders, String (uri)))
+            m_model.create_database (m_library.playlist (), String(uri));
     }
     else
     {
-        m_model.destroy_database ();
-        m_model.update ();
-        m_stats_label.clear ();
+        /* until the playlist is ready, the tree saved last time can still
+         * be browsed and searched */
+        auto uri = audqt::file_entry_get_uri (m_file_entry);
+        bool has_library = (m_library.playlist () != Playlist ());
+
+        /* one already on show keeps its results and expansion */
+        if (! has_library || ! m_model.showing_snapshot (String (uri)))
+        {
+            if (has_library && m_model.show_snapshot (String (uri)))
+                show_results ();
+            else
+            {
+                m_model.destroy_database ();
+                m_model.update ();
+                m_stats_label.clear ();
+            }
+        }
+
+        m_browser_entries.clear ();
+        cancel_load ();
+    }
+
+    show_hide_widgets ();
+}
+
+/* Patches the subtrees of the changed folders.  The view has been told
+ * about the rows that changed, so what is expanded, the selection and the
+ * scroll position stand; only the entry numbers have moved. */
+bool SearchWidget::update_folders (const Index<String> & folders, const String & base_path)
+{
+    if (! m_model.update_folders (m_library.playlist (), folders, base_path))
+        return false;
+    if (! folders.len ())
+        return true;
+
+    show_counts ();
+
+    m_browser_entries.clear ();
+    cancel_load ();
+    return true;
+}
+
+void SearchWidget::database_ready ()
+{
+    /* The filenames were the same, in the same order: what is expanded
+     * and the Browser being filled or scanned still hold. */
+    if (m_model.tree_kept ())
+        show_counts ();
+    else
+    {
+        /* the model has already re-run the last search on the new tree */
+        show_results ();
+
+        /* entry numbers may have moved */
+        m_browser_entries.clear ();
+        cancel_load ();
     }
 
     show_hide_widgets ();
@@ -407,53 +612,74 @@ void SearchWidget::location_changed ()
     StringBuf path = uri_to_filename (uri);
     aud_set_str (CFG_ID, "path", path ? path : uri);
 
+    m_pending_rescans.clear ();
     m_library.begin_add (uri);
     m_library.check_ready_and_update (true);
     reset_monitor ();
 }
 
-// QFileSystemWatcher doesn't support recursion, so we must do it ourselves.
-// TODO: Since MacOS has an abysmally low default per-process FD limit, this
-// means it probably won't work on MacOS with a huge media library.
-// In the case of MacOS, we should use the FSEvents API instead.
-void SearchWidget::walk_library_paths ()
+void SearchWidget::setup_monitor ()
 {
-    if (! m_watcher_paths.isEmpty ())
-        m_watcher->removePaths (m_watcher_paths);
-
-    m_watcher_paths.clear ();
+    m_monitor.clear ();
 
-    auto root = (QString) uri_to_filename (get_uri ());
-    if (root.isEmpty ())
+    StringBuf root = uri_to_filename (get_uri ());
+    if (! root)
         return;
 
-    m_watcher_paths.append (root);
-
-    QDirIterator it (root, QDir::Dirs | QDir::NoDot | QDir::NoDotDot, QDirIterator::Subdirectories);
-    while (it.hasNext ())
-        m_watcher_paths.append (it.next ());
-
-    m_watcher->addPaths (m_watcher_paths);
+    AUDINFO ("Starting monitoring.\n");
+    m_monitor.capture (DirMonitor::create (root, [] (const char * path, void * me) {
+        ((SearchWidget *) me)->rescan_folder (QString (path));
+    }, this));
 }
 
-void SearchWidget::setup_monitor ()
+void SearchWidget::rescan_folder (const QString & path)
 {
-    AUDINFO ("Starting monitoring.\n");
-    m_watcher.capture (new QFileSystemWatcher);
-    m_watcher_paths.clear ();
+    auto root = (QString) uri_to_filename (get_uri ());
 
-    QObject::connect (m_watcher.get (), & QFileSystemWatcher::directoryChanged,
-     [this] (const QString &)
+    // the top folder can only be refreshed as a whole
+    if (path == root)
     {
         AUDINFO ("Library directory changed, refreshing library.\n");
 
+        m_pending_rescans.clear ();
         m_library.begin_add (get_uri ());
         m_library.check_ready_and_update (true);
+        return;
+    }
 
-        walk_library_paths ();
-    });
+    // the monitor has already waited for the folder to settle
+    if (! m_pending_rescans.contains (path))
+        m_pending_rescans.append (path);
+
+    start_rescans ();
+}
+
+/* Rescans the changed folders one at a time, and only while the library is
+ * otherwise idle; anything else waits for the next round. */
+void SearchWidget::start_rescans ()
+{
+    if (m_pending_rescans.isEmpty ())
+        return;
+
+    QString path = m_pending_rescans.first ();
+
+    // gone: its entries go with a rescan of its parent
+    if (! QDir (path).exists ())
+    {
+        m_pending_rescans.removeFirst ();
+        rescan_folder (QFileInfo (path).path ());
+        return;
+    }
+
+    if (m_library.begin_rescan (filename_to_uri (path.toUtf8 ())))
+    {
+        AUDINFO ("Library directory %s changed, rescanning it.\n",
+         (const char *) path.toUtf8 ());
+        m_pending_rescans.removeFirst ();
+    }
 
-    walk_library_paths ();
+    if (! m_pending_rescans.isEmpty ())
+        m_rescan_timer.queue (RESCAN_DELAY, [this] () { start_rescans (); });
 }
 
 void SearchWidget::reset_monitor ()
@@ -462,18 +688,22 @@ void SearchWidget::reset_monitor ()
     {
         setup_monitor ();
     }
-    else if (m_watcher)
+    else if (m_monitor)
     {
         AUDINFO ("Stopping monitoring.\n");
-        m_watcher.clear ();
-        m_watcher_paths.clear ();
+        m_monitor.clear ();
     }
 }
 
 void SearchWidget::do_add (bool play, bool set_title)
 {
     if (m_search_pending)
-        search_timeout ();
+        search_timeout (true);
+
+    // the tree may be a snapshot not matched up with the playlist yet,
+    // even once the library is ready
+    if (! m_library.is_ready () || ! m_model.has_playlist ())
+        return;
 
     auto list = m_library.playlist ();
     Index<PlaylistAddItem> add;
@@ -528,105 +758,346 @@ void SearchWidget::on_item_clicked (const QModelIndex & index)
 {
     // Always queue the load regardless of which playlist is active
     // We'll load into the Browser playlist
-    m_click_timer.queue(200, [this] { on_item_load_timer(); });
+    m_click_timer.queue(CLICK_DELAY, [this] { on_item_load_timer(); });
 }
 
 void SearchWidget::on_item_load_timer ()
 {
-    auto list = m_library.playlist ();
-    Index<PlaylistAddItem> add;
-    
+    // the tree may be a snapshot not matched up with the playlist yet,
+    // even once the library is ready
+    if (! m_library.is_ready () || ! m_model.has_playlist ())
+        return;
+
     // Get ALL selected indexes instead of just the last clicked one
     QModelIndexList selected = m_results_list.selectionModel()->selectedRows();
     
     if (selected.isEmpty())
         return;
     
-    // Use QSet to track unique entry indexes and avoid duplicates
-    QSet<int> seen_entries;
-    
-    // Recursively collect all files in folders and subfolders
-    std::function<void(const Item *)> collect_files = [&](const Item * folder) {
-        // Get children and sort them
-        Index<Item *> children;
-        const_cast<SimpleHash<Key, Item>&>(folder->children).iterate([&](const Key &, Item & child) {
-            children.append(&child);
-        });
-        
-        children.sort([](Item * const & a, Item * const & b) {
-            return str_compare(a->name, b->name) > 0;
-        });
-        
-        // Process in sorted order
-        for (auto child : children)
+    // All files in the selected folders and subfolders, each once
+    Index<int> entries;
+    m_model.collect_entries (selected, entries);
+
+    if (entries.len() > 0)
+        start_load (std::move (entries), false);
+}
+
+/* Fills the Browser playlist with <entries> of the Library playlist.  The
+ * playlist items are put together on a background thread, which gives up as
+ * soon as a newer load is started, so that only the latest selection gets
+ * committed.  What the Browser already holds in common with <entries> at the
+ * start and at the end is left in place (unless <refill>), so that moving
+ * the selection to an enclosing or a neighbouring folder only removes and
+ * adds the difference. */
+void SearchWidget::start_load (Index<int> && entries, bool refill)
+{
+    int serial = ++ m_load_serial;
+
+    if (m_load_thread.joinable ())
+        m_load_thread.join ();
+
+    /* the Browser is refilled anyway if a run is still being replaced */
+    drop_scan ();
+    m_replace_first = -1;
+    m_restore_selected.clear ();
+
+    auto list = m_library.playlist ();
+    int old_len = m_browser_entries.len ();
+    int new_len = entries.len ();
+    int prefix = 0, suffix = 0;
+
+    // Unless the Browser was edited meanwhile
+    if (! refill && m_browser_playlist.exists () &&
+     m_browser_playlist.n_entries () == old_len)
+    {
+        int common = aud::min (old_len, new_len);
+        while (prefix < common && m_browser_entries[prefix] == entries[prefix])
+            prefix ++;
+        while (suffix < common - prefix && m_browser_entries[old_len - 1 - suffix] ==
+         entries[new_len - 1 - suffix])
+            suffix ++;
+
+        // Spot checks of the ends of what is kept (the filenames are
+        // pooled, so they compare by pointer)
+        auto same = [&] (int row, int entry)
+            { return m_browser_playlist.entry_filename (row) == list.entry_filename (entry); };
+
+        if ((prefix && (! same (0, entries[0]) ||
+         ! same (prefix - 1, entries[prefix - 1]))) ||
+         (suffix && (! same (old_len - suffix, entries[new_len - suffix]) ||
+         ! same (old_len - 1, entries[new_len - 1]))))
+            prefix = suffix = 0;
+    }
+
+    Index<int> todo;
+    for (int i = prefix; i < new_len - suffix; i ++)
+        todo.append (entries[i]);
+
+    m_load_entries = std::move (entries);
+    m_load_items.clear ();
+    m_load_prefix = prefix;
+    m_load_suffix = suffix;
+
+    m_load_thread = std::thread ([this, list, serial, todo = std::move (todo)] () {
+        for (int i = 0; i < todo.len (); i ++)
         {
-            if (child->field == SearchField::Title && child->matches.len() > 0)
-            {
-                // This is a file - add each entry if not already seen
-                for (int entry : child->matches)
-                {
-                    if (!seen_entries.contains(entry))
-                    {
-                        seen_entries.insert(entry);
-                        add.append (
-                            list.entry_filename (entry),
-                            list.entry_tuple (entry, Playlist::NoWait),
-                            list.entry_decoder (entry, Playlist::NoWait)
-                        );
-                    }
-                }
-            }
-            else if (child->children.n_items() > 0)
-            {
-                // This is a subfolder, recurse
-                collect_files(child);
-            }
+            if (! (i & 255) && m_load_serial != serial)
+                return;
+
+            int entry = todo[i];
+            m_load_items.append (
+                list.entry_filename (entry),
+                list.entry_tuple (entry, Playlist::NoWait),
+                list.entry_decoder (entry, Playlist::NoWait)
+            );
         }
-    };
-    
-    // Process each selected index
-    for (const QModelIndex & index : selected)
+
+        m_load_done.queue ([this, serial] () { finish_load (serial); });
+    });
+}
+
+void SearchWidget::finish_load (int serial)
+{
+    // a newer load is on its way
+    if (serial != m_load_serial)
+        return;
+
+    m_load_thread.join ();
+
+    int old_len = m_browser_entries.len ();
+    int prefix = m_load_prefix, suffix = m_load_suffix;
+
+    // The Browser changed while we were busy, so none of it can be kept
+    if ((prefix || suffix) && m_browser_playlist.n_entries () != old_len)
     {
-        if (!index.isValid())
-            continue;
-        
-        const Item * item = m_model.item_at_index(index);
-        if (!item)
-            continue;
-        
-        // Check if this is a file or a folder
-        if (item->field == SearchField::Title && item->matches.len() > 0)
+        Index<int> entries = std::move (m_load_entries);
+        start_load (std::move (entries), true);
+        return;
+    }
+
+    // Always update the Browser playlist, never the active one
+    if (! prefix && ! suffix)
+        m_browser_playlist.remove_all_entries ();
+    else if (old_len - prefix - suffix > 0)
+        m_browser_playlist.remove_entries (prefix, old_len - prefix - suffix);
+
+    if (m_load_items.len () > 0)
+        m_browser_playlist.insert_items (prefix, std::move (m_load_items), false);
+
+    m_browser_entries = std::move (m_load_entries);
+
+    // Activate the Browser playlist
+    m_browser_playlist.activate ();
+
+    // once the rows just inserted are there
+    m_scan_waiting = serial;
+    browser_added ();
+}
+
+/* A fresh library is scanned in path order, which may take many minutes
+ * to reach the folder being looked at.  So once the Browser is filled, a
+ * thread of its own goes through the rows that have no metadata yet and
+ * waits for each of them in the Library playlist, which puts the entry at
+ * the front of the scan queue.  The rows are then filled in a batch at a
+ * time, until the next load. */
+void SearchWidget::start_scan ()
+{
+    auto list = m_library.playlist ();
+    auto scan = std::make_shared<ScanPass> ();
+    m_scan = scan;
+
+    Index<int> entries;
+    entries.insert (m_browser_entries.begin (), 0, m_browser_entries.len ());
+
+    std::thread ([this, list, browser = m_browser_playlist, scan,
+     entries = std::move (entries)] () {
+        for (int row = 0; row < entries.len (); row ++)
         {
-            // This is a single file - add it directly
-            for (int entry : item->matches)
-            {
-                if (!seen_entries.contains(entry))
-                {
-                    seen_entries.insert(entry);
-                    add.append (
-                        list.entry_filename (entry),
-                        list.entry_tuple (entry, Playlist::NoWait),
-                        list.entry_decoder (entry, Playlist::NoWait)
-                    );
-                }
-            }
+            if (scan->cancelled)
+                return;
+
+            if (browser.entry_tuple (row, Playlist::NoWait).state () == Tuple::Valid)
+                continue;
+
+            int entry = entries[row];
+            Tuple tuple = list.entry_tuple (entry, Playlist::Wait);
+            if (tuple.state () != Tuple::Valid)
+                continue;
+
+            PluginHandle * decoder = list.entry_decoder (entry, Playlist::NoWait);
+
+            std::lock_guard<std::mutex> lock (scan->mutex);
+            if (scan->cancelled)
+                return;
+
+            bool first = ! scan->rows.len ();
+            scan->rows.append (row);
+            scan->items.append (list.entry_filename (entry), std::move (tuple), decoder);
+
+            // the batch is handed over a little later
+            if (first)
+                scan->done.queue (SCANNED_DELAY, [this] () { fill_scanned (); });
+        }
+    }).detach ();
+}
+
+/* Carries on with the scan pass once no add to the Browser is in
+ * progress: its rows are only where they are expected after that. */
+void SearchWidget::browser_added ()
+{
+    if (! m_browser_playlist.exists () || m_browser_playlist.add_in_progress ())
+        return;
+
+    if (! finish_replace ())
+    {
+        cancel_load ();
+        return;
+    }
+
+    if (m_scan_waiting >= 0)
+    {
+        int serial = m_scan_waiting;
+        m_scan_waiting = -1;
+
+        if (serial == m_load_serial)
+            start_scan ();
+        return;
+    }
+
+    fill_scanned ();
+}
+
+/* Replaces the Browser rows scanned so far with ones that carry the
+ * metadata, one run of consecutive rows at a time.  The insert is done by
+ * the adder, in front of the old rows, so that the Browser never gets
+ * shorter; the old rows go, and the next run follows, once it is in.  The
+ * playing row is left alone; so is everything if the Browser has been
+ * edited meanwhile. */
+void SearchWidget::fill_scanned ()
+{
+    if (! m_scan)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock (m_scan->mutex);
+        for (int i = 0; i < m_scan->rows.len (); i ++)
+        {
+            m_fill_rows.append (m_scan->rows[i]);
+            m_fill_items.append (std::move (m_scan->items[i]));
         }
-        else if (item->children.n_items() > 0)
+
+        m_scan->rows.clear ();
+        m_scan->items.clear ();
+    }
+
+    while (m_browser_playlist.exists () && ! m_browser_playlist.add_in_progress ())
+    {
+        if (! finish_replace () ||
+         m_browser_playlist.n_entries () != m_browser_entries.len ())
+        {
+            cancel_load ();
+            return;
+        }
+
+        // rows that still hold the same files (pooled, so compared by pointer)
+        int playing = m_browser_playlist.get_position ();
+        auto fits = [&] (int i) {
+            return m_fill_rows[i] != playing &&
+             m_browser_playlist.entry_filename (m_fill_rows[i]) == m_fill_items[i].filename;
+        };
+
+        while (m_fill_next < m_fill_rows.len () && ! fits (m_fill_next))
+            m_fill_next ++;
+
+        if (m_fill_next == m_fill_rows.len ())
+        {
+            m_fill_rows.clear ();
+            m_fill_items.clear ();
+            m_fill_next = 0;
+            return;
+        }
+
+        int first = m_fill_rows[m_fill_next];
+        Index<PlaylistAddItem> run;
+
+        for (; m_fill_next < m_fill_rows.len () &&
+         m_fill_rows[m_fill_next] == first + run.len () && fits (m_fill_next); m_fill_next ++)
         {
-            // This is a folder - recursively collect all files
-            collect_files(item);
+            m_restore_selected.append (m_browser_playlist.entry_selected (m_fill_rows[m_fill_next]));
+            run.append (std::move (m_fill_items[m_fill_next]));
         }
+
+        m_replace_first = first;
+        m_replace_total = m_browser_playlist.n_entries ();
+        m_restore_focus = m_browser_playlist.get_focus ();
+
+        m_browser_playlist.insert_items (first, std::move (run), false);
     }
-    
-    if (add.len() > 0)
+}
+
+/* Once the run fill_scanned () inserted last is in, removes the rows it
+ * replaces and puts the selection and the focus back.  Returns false if
+ * the Browser was edited meanwhile, leaving it as it is. */
+bool SearchWidget::finish_replace ()
+{
+    if (m_replace_first < 0)
+        return true;
+
+    int first = m_replace_first, len = m_restore_selected.len ();
+    m_replace_first = -1;
+
+    // the new rows, and behind them the old ones with the same files
+    // (pooled, so compared by pointer)
+    auto same = [&] (int r)
+        { return m_browser_playlist.entry_filename (first + r) ==
+         m_browser_playlist.entry_filename (first + len + r); };
+
+    if (m_browser_playlist.n_entries () != m_replace_total + len ||
+     ! same (0) || ! same (len - 1))
     {
-        // Always update the Browser playlist, never the active one
-        m_browser_playlist.remove_all_entries ();
-        m_browser_playlist.insert_items (-1, std::move (add), false);
-        
-        // Activate the Browser playlist
-        m_browser_playlist.activate ();
+        m_restore_selected.clear ();
+        return false;
     }
+
+    m_browser_playlist.remove_entries (first + len, len);
+
+    for (int r = 0; r < len; r ++)
+    {
+        if (m_restore_selected[r])
+            m_browser_playlist.select_entry (first + r, true);
+    }
+
+    if (m_restore_focus >= 0)
+        m_browser_playlist.set_focus (m_restore_focus);
+
+    m_restore_selected.clear ();
+    return true;
+}
+
+void SearchWidget::cancel_load ()
+{
+    m_load_serial ++;
+    m_load_done.stop ();
+    drop_scan ();
+}
+
+/* Stops the scan pass and forgets what it has left to do.  A run being
+ * replaced is still finished by browser_added (), so that its old rows
+ * don't stay behind. */
+void SearchWidget::drop_scan ()
+{
+    if (m_scan)
+    {
+        std::lock_guard<std::mutex> lock (m_scan->mutex);
+        m_scan->cancelled = true;
+        m_scan->done.stop ();
+    }
+
+    m_scan.reset ();
+    m_scan_waiting = -1;
+    m_fill_rows.clear ();
+    m_fill_items.clear ();
+    m_fill_next = 0;
 }
 
 void SearchWidget::show_context_menu (const QPoint & global_pos)
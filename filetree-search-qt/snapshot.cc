@@ -0,0 +1,287 @@
+/*
+ * snapshot.cc
+ * Copyright 2026 Zineffable1
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+#include "search-model.h"
+
+#include <string.h>
+
+#include <unordered_map>
+
+#include <QByteArray>
+#include <QSaveFile>
+
+/* The file holds the items in Database::items order, that is parents before
+ * their children and children in display order, so that the tree can be put
+ * back together in a single pass without any sorting.  The names are not
+ * copied: the items point straight into the mapped file.  The layout is
+ * that of the machine it was written on; a snapshot from elsewhere just
+ * fails to load and is replaced with the next build.
+ *
+ *     Header
+ *     base path, NUL-terminated, padded to 4 bytes
+ *     Record[n_items]
+ *     int32_t matches[n_matches]
+ *     names, each NUL-terminated, names_size bytes in all */
+
+static constexpr char snapshot_magic[8] = {'F', 'T', 'S', 'N', 'A', 'P', '\r', '\n'};
+static constexpr uint32_t snapshot_version = 2;
+static constexpr uint32_t no_name = (uint32_t) -1;
+
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size, record_size;
+    uint32_t path_size;      /* including the NUL and the padding */
+    uint32_t n_items, n_matches, names_size;
+    uint64_t stamp;
+};
+
+struct SnapshotRecord
+{
+    uint32_t name, folded;   /* offsets into the names, or no_name */
+    uint32_t key;            /* likewise; no_name if it is the name */
+    int32_t parent;          /* index of the parent record, or -1 */
+    uint32_t n_children, n_matches;
+    uint32_t field;
+};
+
+static constexpr uint32_t padded (uint32_t size)
+    { return (size + 3) & ~3u; }
+
+uint64_t Database::make_stamp (const Index<String> & filenames, const char * base_path)
+{
+    // FNV-1a over the base path and the filenames, in order
+    uint64_t hash = 0xcbf29ce484222325;
+    auto add = [& hash] (const char * str) {
+        for (; * str; str ++)
+            hash = (hash ^ (unsigned char) * str) * 0x100000001b3;
+        hash = (hash ^ 0xff) * 0x100000001b3;
+    };
+
+    add (base_path ? base_path : "");
+    for (auto & filename : filenames)
+        add (filename ? (const char *) filename : "");
+
+    return hash ? hash : 1;
+}
+
+bool Database::save (const char * path) const
+{
+    QByteArray names;
+    std::unordered_map<const char *, uint32_t> offsets;
+
+    auto add_name = [&] (const char * name) {
+        auto found = offsets.find (name);
+        if (found != offsets.end ())
+            return found->second;
+
+        uint32_t offset = names.size ();
+        names.append (name, strlen (name) + 1);
+        offsets.emplace (name, offset);
+        return offset;
+    };
+
+    Index<SnapshotRecord> records;
+    Index<int32_t> matches;
+
+    // items dropped by SearchModel::update_folders() are left out
+    Index<int> record_of;
+    record_of.insert (0, items.len ());
+
+    for (const Item * item : items)
+    {
+        if (item->removed)
+            continue;
+
+        record_of[item->id] = records.len ();
+
+        SnapshotRecord record = SnapshotRecord ();
+        record.name = add_name (item->name);
+        record.folded = ! item->folded ? no_name :
+         (item->folded == item->name) ? record.name : add_name (item->folded);
+        record.key = (item->key == item->name) ? no_name : add_name (item->key);
+        record.parent = item->parent ? record_of[item->parent->id] : -1;
+        record.n_children = item->sorted.len ();
+        record.n_matches = item->matches.len ();
+        record.field = (uint32_t) item->field;
+        records.append (record);
+
+        for (int entry : item->matches)
+            matches.append (entry);
+    }
+
+    const char * base = base_path ? (const char *) base_path : "";
+    uint32_t base_len = strlen (base);
+
+    SnapshotHeader header = SnapshotHeader ();
+    memcpy (header.magic, snapshot_magic, sizeof header.magic);
+    header.version = snapshot_version;
+    header.header_size = sizeof (SnapshotHeader);
+    header.record_size = sizeof (SnapshotRecord);
+    header.path_size = padded (base_len + 1);
+    header.n_items = records.len ();
+    header.n_matches = matches.len ();
+    header.names_size = names.size ();
+    header.stamp = stamp;
+
+    QByteArray base_buf (header.path_size, 0);
+    memcpy (base_buf.data (), base, base_len);
+
+    // written to a temporary file first, so a reader never sees half of it
+    QSaveFile file (QString::fromUtf8 (path));
+    if (! file.open (QIODevice::WriteOnly))
+    {
+        AUDWARN ("Cannot write %s: %s\n", path, (const char *) file.errorString ().toUtf8 ());
+        return false;
+    }
+
+    file.write ((const char *) & header, sizeof header);
+    file.write (base_buf);
+    file.write ((const char *) records.begin (), sizeof (SnapshotRecord) * records.len ());
+    file.write ((const char *) matches.begin (), sizeof (int32_t) * matches.len ());
+    file.write (names);
+
+    if (! file.commit ())
+    {
+        AUDWARN ("Cannot write %s: %s\n", path, (const char *) file.errorString ().toUtf8 ());
+        return false;
+    }
+
+    return true;
+}
+
+bool Database::load (const char * path, const String & base_path)
+{
+    StopWatch timer;
+
+    SmartPtr<QFile> file (new QFile (QString::fromUtf8 (path)));
+    if (! file->open (QIODevice::ReadOnly))
+        return false;
+
+    qint64 size = file->size ();
+    if (size < (qint64) sizeof (SnapshotHeader))
+        return false;
+
+    const char * data = (const char *) file->map (0, size);
+    if (! data)
+        return false;
+
+    SnapshotHeader header;
+    memcpy (& header, data, sizeof header);
+
+    if (memcmp (header.magic, snapshot_magic, sizeof header.magic) ||
+     header.version != snapshot_version ||
+     header.header_size != sizeof (SnapshotHeader) ||
+     header.record_size != sizeof (SnapshotRecord) ||
+     header.path_size % 4 || ! header.names_size ||
+     (qint64) sizeof (SnapshotHeader) + header.path_size +
+     (qint64) sizeof (SnapshotRecord) * header.n_items +
+     (qint64) sizeof (int32_t) * header.n_matches + header.names_size != size)
+    {
+        AUDWARN ("Ignoring invalid snapshot %s\n", path);
+        return false;
+    }
+
+    const char * base = data + sizeof (SnapshotHeader);
+    if (! memchr (base, 0, header.path_size) ||
+     strcmp (base, base_path ? (const char *) base_path : ""))
+        return false;
+
+    auto records = (const SnapshotRecord *) (base + header.path_size);
+    auto matches = (const int32_t *) (records + header.n_items);
+    auto names = (const char *) (matches + header.n_matches);
+
+    if (names[header.names_size - 1])
+        return false;
+
+    auto valid_name = [&] (uint32_t offset)
+        { return offset < header.names_size; };
+
+    arenas.append (new Arena);
+    Arena & arena = * arenas[0];
+
+    Index<Item *> by_record;
+    by_record.insert (0, header.n_items);
+
+    int n_roots = 0;
+    for (uint32_t i = 0; i < header.n_items; i ++)
+    {
+        if (records[i].parent < 0)
+            n_roots ++;
+    }
+
+    sorted_roots.reserve (arena, n_roots);
+    uint32_t used_matches = 0;
+
+    for (uint32_t i = 0; i < header.n_items; i ++)
+    {
+        auto & record = records[i];
+
+        // parents must come first and have room for all their children
+        Item * parent = nullptr;
+        if (record.parent >= 0)
+        {
+            if ((uint32_t) record.parent >= i)
+                return false;
+
+            parent = by_record[record.parent];
+            if (parent->sorted.len () >= (int) records[record.parent].n_children)
+                return false;
+        }
+
+        if (! valid_name (record.name) ||
+         (record.folded != no_name && ! valid_name (record.folded)) ||
+         (record.key != no_name && ! valid_name (record.key)) ||
+         record.field >= (uint32_t) SearchField::count ||
+         record.n_matches > header.n_matches - used_matches)
+            return false;
+
+        Item * item = arena.create<Item> ((SearchField) record.field,
+         names + record.name, (record.folded == no_name) ? nullptr :
+         names + record.folded, (record.key == no_name) ? names + record.name :
+         names + record.key, parent);
+
+        item->sorted.reserve (arena, record.n_children);
+        item->matches.reserve (arena, record.n_matches);
+        for (uint32_t m = 0; m < record.n_matches; m ++)
+            item->matches.append (matches[used_matches ++]);
+
+        (parent ? parent->sorted : sorted_roots).append (item);
+        by_record[i] = item;
+    }
+
+    for (uint32_t i = 0; i < header.n_items; i ++)
+    {
+        if (by_record[i]->sorted.len () != (int) records[i].n_children)
+            return false;
+    }
+
+    finish_loaded ();
+
+    this->base_path = base_path;
+    stamp = header.stamp;
+    snapshot = std::move (file);
+    build_ms = timer.elapsed_ms ();
+
+    AUDINFO ("Loaded search tree of %d items from %s in %.0f ms\n",
+     items.len (), path, build_ms);
+
+    return true;
+}
@@ -0,0 +1,55 @@
+/*
+ * timing.h
+ * Copyright 2026 Zineffable1
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <chrono>
+
+#include <libaudcore/runtime.h>
+
+// Wall-clock timer for the phases worth reporting.  It starts when it is
+// constructed; one with a name logs the time taken (at debug level) when it
+// goes out of scope.
+class StopWatch
+{
+public:
+    explicit StopWatch (const char * name = nullptr) :
+        m_name (name) { restart (); }
+
+    ~StopWatch ()
+    {
+        if (m_name)
+            AUDDBG ("%s took %.1f ms\n", m_name, elapsed_ms ());
+    }
+
+    void restart () { m_start = std::chrono::steady_clock::now (); }
+
+    double elapsed_ms () const
+    {
+        auto elapsed = std::chrono::steady_clock::now () - m_start;
+        return std::chrono::duration<double, std::milli> (elapsed).count ();
+    }
+
+private:
+    const char * m_name;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+#endif // TIMING_H
@@ -0,0 +1,97 @@
+/*
+ * trigram-index.cc
+ * Copyright 2026 Zineffable1
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+#include "trigram-index.h"
+
+#include <algorithm>
+#include <string.h>
+
+#include "name-match.h"
+
+static unsigned trigram_code (const char * s)
+{
+    return ((unsigned) fold_ascii (s[0]) << 16) |
+           ((unsigned) fold_ascii (s[1]) << 8) |
+            (unsigned) fold_ascii (s[2]);
+}
+
+void TrigramIndex::add (int id, const char * name)
+{
+    int len = strlen (name);
+
+    for (int i = 0; i + min_length <= len; i ++)
+    {
+        Trigram key {trigram_code (name + i)};
+
+        Index<int> * ids = m_postings.lookup (key);
+        if (! ids)
+            ids = m_postings.add (key, Index<int> ());
+
+        /* a name may contain the same trigram more than once */
+        if (! ids->len () || (* ids)[ids->len () - 1] != id)
+            ids->append (id);
+    }
+}
+
+bool TrigramIndex::lookup (const char * term, Index<int> & ids)
+{
+    ids.clear ();
+
+    int len = strlen (term);
+    if (len < min_length)
+        return false;
+
+    Index<const Index<int> *> lists;
+
+    for (int i = 0; i + min_length <= len; i ++)
+    {
+        const Index<int> * list = m_postings.lookup ({trigram_code (term + i)});
+        if (! list)
+            return true; /* some trigram occurs nowhere, so nothing matches */
+
+        lists.append (list);
+    }
+
+    /* intersect the shortest lists first to keep the working set small */
+    std::sort (lists.begin (), lists.end (),
+     [] (const Index<int> * a, const Index<int> * b) { return a->len () < b->len (); });
+
+    for (int id : * lists[0])
+        ids.append (id);
+
+    for (int l = 1; l < lists.len () && ids.len (); l ++)
+    {
+        auto & list = * lists[l];
+        int kept = 0, j = 0;
+
+        for (int id : ids)
+        {
+            while (j < list.len () && list[j] < id)
+                j ++;
+            if (j == list.len ())
+                break;
+            if (list[j] == id)
+                ids[kept ++] = id;
+        }
+
+        ids.remove (kept, ids.len () - kept);
+    }
+
+    return true;
+}
@@ -0,0 +1,62 @@
+/*
+ * trigram-index.h
+ * Copyright 2026 Zineffable1
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+#ifndef TRIGRAMINDEX_H
+#define TRIGRAMINDEX_H
+
+#include <libaudcore/index.h>
+#include <libaudcore/multihash.h>
+
+// Maps each three-byte sequence to the (sorted) ids of the names containing
+// it, so that a substring search only has to look at a few candidates.
+// ASCII upper case is folded as names are added; terms must be lower case.
+class TrigramIndex
+{
+public:
+    static constexpr int min_length = 3;
+
+    void clear () { m_postings.clear (); }
+
+    // ids must be added in increasing order
+    void add (int id, const char * name);
+
+    // Fills <ids> with the sorted ids of all names that may contain <term>.
+    // The candidates still have to be checked with strstr().  Returns false
+    // if <term> is too short to be looked up, in which case every name is a
+    // candidate.
+    bool lookup (const char * term, Index<int> & ids);
+
+private:
+    struct Trigram
+    {
+        unsigned code;
+
+        bool operator== (const Trigram & b) const
+            { return code == b.code; }
+        unsigned hash () const
+        {
+            unsigned h = code * 0x9e3779b1;
+            return h ^ (h >> 15);
+        }
+    };
+
+    SimpleHash<Trigram, Index<int>> m_postings;
+};
+
+#endif // TRIGRAMINDEX_H